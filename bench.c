@@ -0,0 +1,540 @@
+/*
+ * load generator for the battle server:
+ * opens many connections at once, names every bot, and plays full battles
+ * with a configurable think time between seeing the menu and striking.
+ * some bots type a character at a time like a telnet client in character
+ * mode, the rest send whole lines; some of their turns are spent chatting.
+ * bots can also speak the server's binary protocol instead of text.
+ * with -i the bots only connect and then say nothing, to see how many idle
+ * connections the server holds and what they cost it (run it with a long -N,
+ * and with both processes' fd limits raised for a million).
+ *
+ * at the end it reports connections/sec, games/sec and the latency from
+ * sending a command to the first byte of the server's response.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#ifndef PORT
+#define PORT 30100
+#endif
+
+#define MAXEVENTS 256
+// most of the server's output a bot keeps while looking for prompts
+#define INBUF 4096
+// bots connecting to a loopback address past this many each get the next source
+// address in 127.0.0.0/8, so the ephemeral ports of one address don't run out
+#define BOTSPERADDR 20000
+// latency histogram: 16 linear sub-buckets per power of two microseconds
+#define SUBBITS 4
+#define NBUCKETS (64 << SUBBITS)
+
+// what the server says that a bot reacts to
+#define ASKNAME "What is your name?"
+#define MENU "(s)peak something"
+#define SAY "Say something..."
+#define WON "You win!"
+
+// the binary protocol, as server.c defines it
+#define BMAGIC 0xb7
+enum { B_NAME = 1, B_ATTACK, B_POWERMOVE, B_CHAT };
+enum { B_WELCOME = 0x81, B_ENGAGE, B_MOVE, B_STATUS, B_CHATFROM, B_OVER, B_TIMEOUT };
+#define CHATLINE "good game so far"
+
+enum { CONNECTING, PLAYING, CLOSED };
+
+struct bot {
+    int fd;
+    int id;
+    int state;
+    // types a character per send() instead of a line at a time
+    int charmode;
+    // answers the name prompt with the binary protocol's magic byte, and once
+    // it has, in holds frames rather than text
+    int binary;
+    int framed;
+    // output not yet scanned for prompts, INBUF bytes; an idle bot has none
+    char* in;
+    int inlen;
+    // when the last command went out (us), or 0 if no response is owed
+    long sentat;
+    // what to send once the think time is up, or 0 for nothing
+    char next;
+    long due;
+    // link in the think queue
+    struct bot* thinknext;
+};
+
+// bots thinking about their move; the think time is fixed, so they are due in queue order
+struct thinkqueue {
+    struct bot* head;
+    struct bot* tail;
+};
+
+struct stats {
+    long connects;
+    long failures;
+    long games;
+    long commands;
+    long chats;
+    // bytes received and commands sent by text bots [0] and binary bots [1]
+    long bytesin[2];
+    long sent[2];
+    long latency[NBUCKETS];
+};
+
+struct stats st;
+struct thinkqueue thinking;
+long thinkus;
+int chatpct;
+
+long now_us(void);
+void record(long us);
+long percentile(double pct);
+void sendall(struct bot* b, const char* s, int len);
+void typeline(struct bot* b, const char* s);
+void scan(struct bot* b);
+void scanframes(struct bot* b);
+void sendframe(struct bot* b, int type, const char* payload, int len);
+void think(struct bot* b, char cmd);
+
+int main(int argc, char** argv)
+{
+    struct sockaddr_in r;
+    struct epoll_event ev, events[MAXEVENTS];
+    struct bot* bots;
+    const char* host = "127.0.0.1";
+    int port = PORT, nbots = 1000, seconds = 10, charpct = 50, binpct = 0, idle = 0;
+    int opt, i, epfd, nready, held;
+    static char discard[INBUF];
+
+    thinkus = 0;
+    chatpct = 10;
+    while((opt = getopt(argc, argv, "h:p:c:d:k:m:s:x:i")) != -1) {
+	switch(opt) {
+	case 'h': host = optarg; break;
+	case 'p': port = atoi(optarg); break;
+	case 'c': nbots = atoi(optarg); break;
+	case 'd': seconds = atoi(optarg); break;
+	case 'k': thinkus = atol(optarg) * 1000; break;
+	case 'm': charpct = atoi(optarg); break;
+	case 's': chatpct = atoi(optarg); break;
+	case 'x': binpct = atoi(optarg); break;
+	case 'i': idle = 1; break;
+	default:
+	    fprintf(stderr, "usage: %s [-h host] [-p port] [-c connections] [-d seconds]\n"
+		"\t[-k think ms] [-m %% character-mode bots] [-s %% turns spent chatting]\n"
+		"\t[-x %% binary protocol bots] [-i]\n", argv[0]);
+	    exit(1);
+	}
+    }
+
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    memset(&r, 0, sizeof(r));
+    r.sin_family = AF_INET;
+    r.sin_port = htons(port);
+    if(inet_pton(AF_INET, host, &r.sin_addr) != 1) {
+	fprintf(stderr, "bad address %s\n", host);
+	exit(1);
+    }
+    if(!(bots = calloc(nbots, sizeof(struct bot)))) {
+	perror("calloc");
+	exit(1);
+    }
+    if((epfd = epoll_create1(0)) < 0) {
+	perror("epoll_create1");
+	exit(1);
+    }
+    srand(getpid());
+
+    long start = now_us();
+    long lastconnect = start;
+    for(i = 0; i < nbots; i++) {
+	struct bot* b = &bots[i];
+	int yes = 1;
+	b->id = i;
+	b->charmode = rand() % 100 < charpct;
+	b->binary = rand() % 100 < binpct;
+	if(!idle && !(b->in = malloc(INBUF))) {
+	    perror("malloc");
+	    exit(1);
+	}
+	if((b->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+	    perror("socket");
+	    exit(1);
+	}
+	// character-mode bots must not have their keystrokes merged by Nagle
+	setsockopt(b->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	if((ntohl(r.sin_addr.s_addr) >> 24) == 127 && i >= BOTSPERADDR) {
+	    struct sockaddr_in from;
+	    memset(&from, 0, sizeof(from));
+	    from.sin_family = AF_INET;
+	    from.sin_addr.s_addr = htonl(0x7f000001 + i / BOTSPERADDR);
+	    // the port is picked at connect(), for this address and the server's together
+	    setsockopt(b->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &yes, sizeof(yes));
+	    if(bind(b->fd, (struct sockaddr*)&from, sizeof(from)) == -1) {
+		perror("bind");
+		exit(1);
+	    }
+	}
+	if(connect(b->fd, (struct sockaddr*)&r, sizeof(r)) == -1 && errno != EINPROGRESS) {
+	    perror("connect");
+	    exit(1);
+	}
+	b->state = CONNECTING;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = b;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, b->fd, &ev) == -1) {
+	    perror("epoll_ctl");
+	    exit(1);
+	}
+    }
+
+    long end = start + seconds * 1000000L;
+    long now;
+    while((now = now_us()) < end) {
+	int timeout = (end - now) / 1000 + 1;
+	if(thinking.head) {
+	    long wait = thinking.head->due - now;
+	    timeout = wait > 0 ? wait / 1000 + 1 : 0;
+	}
+	nready = epoll_wait(epfd, events, MAXEVENTS, timeout);
+	if(nready == -1) {
+	    if(errno != EINTR) {
+		perror("epoll_wait");
+		exit(1);
+	    }
+	    continue;
+	}
+	for(i = 0; i < nready; i++) {
+	    struct bot* b = events[i].data.ptr;
+	    if(b->state == CLOSED) {
+		continue;
+	    }
+	    if(b->state == CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(b->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if(err) {
+		    st.failures++;
+		    b->state = CLOSED;
+		    close(b->fd);
+		    continue;
+		}
+		st.connects++;
+		lastconnect = now_us();
+		b->state = PLAYING;
+	    }
+	    if(!(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+		continue;
+	    }
+	    // an idle bot reads only to notice the server hanging up
+	    while(idle && b->state == PLAYING) {
+		int n = recv(b->fd, discard, sizeof(discard), 0);
+		if(n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+		    st.failures++;
+		    b->state = CLOSED;
+		    close(b->fd);
+		} else if(n == -1) {
+		    break;
+		}
+	    }
+	    if(idle) {
+		continue;
+	    }
+	    // edge-triggered: read until the socket is empty
+	    while(b->state == PLAYING) {
+		int n = recv(b->fd, b->in + b->inlen, INBUF - b->inlen, 0);
+		if(n > 0) {
+		    if(b->sentat) {
+			record(now_us() - b->sentat);
+			b->sentat = 0;
+		    }
+		    b->inlen += n;
+		    st.bytesin[b->binary] += n;
+		    if(b->framed) {
+			scanframes(b);
+		    } else {
+			scan(b);
+		    }
+		} else if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		    break;
+		} else {
+		    st.failures++;
+		    b->state = CLOSED;
+		    close(b->fd);
+		}
+	    }
+	}
+	// strike for every bot whose think time is up
+	now = now_us();
+	while(thinking.head && thinking.head->due <= now) {
+	    struct bot* b = thinking.head;
+	    thinking.head = b->thinknext;
+	    if(!thinking.head) {
+		thinking.tail = NULL;
+	    }
+	    if(b->state != PLAYING) {
+		continue;
+	    }
+	    char cmd[2] = { b->next, '\0' };
+	    b->next = 0;
+	    st.commands++;
+	    st.sent[b->binary]++;
+	    b->sentat = now_us();
+	    // a binary bot says what it has to say along with the command
+	    if(b->framed && cmd[0] == 's') {
+		st.chats++;
+		sendframe(b, B_CHAT, CHATLINE, strlen(CHATLINE));
+	    } else if(b->framed) {
+		sendframe(b, cmd[0] == 'p' ? B_POWERMOVE : B_ATTACK, NULL, 0);
+	    } else if(b->charmode) {
+		sendall(b, cmd, 1);
+	    } else {
+		typeline(b, cmd);
+	    }
+	}
+    }
+
+    double secs = (now_us() - start) / 1e6;
+    double rampsecs = (lastconnect - start) / 1e6;
+    printf("connections: %ld ok, %ld failed, %.0f/s over %.3f s\n",
+	st.connects, st.failures, rampsecs > 0 ? st.connects / rampsecs : 0.0, rampsecs);
+    if(idle) {
+	for(i = held = 0; i < nbots; i++) {
+	    held += bots[i].state == PLAYING;
+	}
+	printf("idle: %d connections held to the end\n", held);
+	return 0;
+    }
+    printf("games: %ld finished, %.1f/s\n", st.games, st.games / secs);
+    printf("commands: %ld sent, %ld chats, %.1f/s\n", st.commands, st.chats, st.commands / secs);
+    printf("latency us: p50 %ld p99 %ld p999 %ld\n", percentile(0.5), percentile(0.99), percentile(0.999));
+    if(binpct) {
+	printf("bytes in per command: text %.1f, binary %.1f\n",
+	    st.sent[0] ? (double)st.bytesin[0] / st.sent[0] : 0.0, st.sent[1] ? (double)st.bytesin[1] / st.sent[1] : 0.0);
+    }
+    return 0;
+}
+
+/* microseconds on the monotonic clock */
+long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* bucket of a latency of us microseconds; exact below 2^SUBBITS, then
+ * 2^SUBBITS buckets per power of two */
+static int bucket(long us)
+{
+    if(us < (1 << SUBBITS)) {
+	return us < 0 ? 0 : us;
+    }
+    int msb = 63 - __builtin_clzl(us);
+    return ((msb - SUBBITS + 1) << SUBBITS) + ((us >> (msb - SUBBITS)) & ((1 << SUBBITS) - 1));
+}
+
+/* smallest latency that falls in bucket i */
+static long bucketfloor(int i)
+{
+    if(i < (1 << SUBBITS)) {
+	return i;
+    }
+    int msb = (i >> SUBBITS) + SUBBITS - 1;
+    return (1L << msb) + ((long)(i & ((1 << SUBBITS) - 1)) << (msb - SUBBITS));
+}
+
+void record(long us)
+{
+    st.latency[bucket(us)]++;
+}
+
+/* the latency below which pct of the recorded responses fall */
+long percentile(double pct)
+{
+    long total = 0, seen = 0;
+    int i;
+
+    for(i = 0; i < NBUCKETS; i++) {
+	total += st.latency[i];
+    }
+    for(i = 0; i < NBUCKETS; i++) {
+	seen += st.latency[i];
+	if(total && seen >= pct * total) {
+	    return bucketfloor(i);
+	}
+    }
+    return 0;
+}
+
+/* sends len bytes of s; the server drains its sockets, so a short
+ * message only fails to go out if the connection is gone */
+void sendall(struct bot* b, const char* s, int len)
+{
+    if(send(b->fd, s, len, MSG_NOSIGNAL) != len) {
+	st.failures++;
+	b->state = CLOSED;
+	close(b->fd);
+    }
+}
+
+/* sends s and a line end, a line at a time or a character at a time */
+void typeline(struct bot* b, const char* s)
+{
+    int i;
+
+    if(!b->charmode) {
+	char line[128];
+	int len = snprintf(line, sizeof(line), "%s\r\n", s);
+	sendall(b, line, len);
+	return;
+    }
+    for(i = 0; s[i] && b->state == PLAYING; i++) {
+	sendall(b, s + i, 1);
+    }
+    if(b->state == PLAYING) {
+	sendall(b, "\r\n", 2);
+    }
+}
+
+/* queues b to send cmd once its think time is up */
+void think(struct bot* b, char cmd)
+{
+    b->next = cmd;
+    b->due = now_us() + thinkus;
+    b->thinknext = NULL;
+    if(thinking.tail) {
+	thinking.tail->thinknext = b;
+    } else {
+	thinking.head = b;
+    }
+    thinking.tail = b;
+}
+
+/* acts on every prompt in b's unscanned output, in order; a prompt split
+ * across reads is kept until the rest of it arrives */
+void scan(struct bot* b)
+{
+    static const char* prompts[] = { ASKNAME, MENU, SAY, WON };
+    int pos = 0;
+
+    while(1) {
+	char* first = NULL;
+	int which = -1, i;
+	// the server sends NUL bytes inside some messages, so search with memmem
+	for(i = 0; i < 4; i++) {
+	    char* at = memmem(b->in + pos, b->inlen - pos, prompts[i], strlen(prompts[i]));
+	    if(at && (!first || at < first)) {
+		first = at;
+		which = i;
+	    }
+	}
+	if(!first) {
+	    break;
+	}
+	char* from = b->in + pos;
+	pos = first - b->in + strlen(prompts[which]);
+	if(which == 0 && b->binary) {
+	    char name[32];
+	    int len = sprintf(name, "%cbot%d", BMAGIC, b->id);
+	    // the magic byte, then the name as a frame; what follows is frames too
+	    sendall(b, name, 1);
+	    sendframe(b, B_NAME, name + 1, len - 1);
+	    b->framed = 1;
+	    memmove(b->in, b->in + pos, b->inlen - pos);
+	    b->inlen -= pos;
+	    scanframes(b);
+	    return;
+	} else if(which == 0) {
+	    char name[32];
+	    sprintf(name, "bot%d", b->id);
+	    typeline(b, name);
+	} else if(which == 1) {
+	    // our turn: speak now and then, otherwise strike
+	    if(rand() % 100 < chatpct) {
+		think(b, 's');
+	    } else {
+		think(b, rand() % 4 == 0 && memmem(from, first - from, "(p)owermove", 11) ? 'p' : 'a');
+	    }
+	} else if(which == 2) {
+	    st.chats++;
+	    b->sentat = now_us();
+	    typeline(b, "good game so far");
+	} else {
+	    st.games++;
+	}
+	if(b->state != PLAYING) {
+	    return;
+	}
+    }
+    // keep just enough to finish a prompt that was cut off
+    int keep = b->inlen - pos < (int)sizeof(ASKNAME) - 1 ? b->inlen - pos : (int)sizeof(ASKNAME) - 1;
+    memmove(b->in, b->in + b->inlen - keep, keep);
+    b->inlen = keep;
+}
+
+/* sends a binary protocol frame of type with len bytes of payload */
+void sendframe(struct bot* b, int type, const char* payload, int len)
+{
+    char f[2 + 255];
+
+    f[0] = len + 1;
+    f[1] = type;
+    memcpy(f + 2, payload, len);
+    if(b->state == PLAYING) {
+	sendall(b, f, len + 2);
+    }
+}
+
+/* acts on every whole frame in b's input; a frame cut off is kept until the rest arrives */
+void scanframes(struct bot* b)
+{
+    unsigned char* in = (unsigned char*)b->in;
+    int pos = 0;
+
+    while(pos < b->inlen) {
+	unsigned char* f = in + pos;
+	// a zero length is padding, like the NUL after the name prompt
+	if(!f[0]) {
+	    pos++;
+	    continue;
+	}
+	if(pos + 1 + f[0] > b->inlen) {
+	    break;
+	}
+	if(f[1] == B_STATUS && f[8]) {
+	    // our turn: speak now and then, otherwise strike
+	    if(rand() % 100 < chatpct) {
+		think(b, 's');
+	    } else {
+		think(b, rand() % 4 == 0 && f[4] ? 'p' : 'a');
+	    }
+	} else if(f[1] == B_OVER && f[2]) {
+	    st.games++;
+	}
+	pos += 1 + f[0];
+    }
+    memmove(b->in, b->in + pos, b->inlen - pos);
+    b->inlen -= pos;
+}
@@ -0,0 +1,74 @@
+#!/bin/sh
+# holds a million idle connections (or $1) to a fresh ./battle over loopback,
+# and fails if the server's resident memory grew by more than $2 bytes (512)
+# for each of them. run it as root: it raises the fd limits, widens the local
+# port range and deepens the listen backlog. bench -i spreads the connections
+# over 127.0.0.0/8 source addresses, so no one address runs out of ports.
+#
+# HOLD (300) is how many seconds bench gets to open them all; PORT as for make.
+
+n=${1:-1000000}
+max=${2:-512}
+hold=${HOLD:-300}
+port=${PORT:-26326}
+
+fail() {
+    echo "idletest: $*" >&2
+    exit 1
+}
+
+# the server and bench each need an fd per connection, and a few more
+fds=$((n + 1024))
+if [ "$(cat /proc/sys/fs/nr_open)" -lt $fds ]; then
+    sysctl -qw fs.nr_open=$fds || fail "can't raise fs.nr_open to $fds"
+fi
+if [ "$(cat /proc/sys/fs/file-max)" -lt $((2 * fds)) ]; then
+    sysctl -qw fs.file-max=$((2 * fds)) || fail "can't raise fs.file-max to $((2 * fds))"
+fi
+if [ "$(ulimit -Hn)" != unlimited ] && [ "$(ulimit -Hn)" -lt $fds ]; then
+    ulimit -Hn $fds || fail "can't raise RLIMIT_NOFILE to $fds"
+fi
+if [ "$(ulimit -Sn)" != unlimited ] && [ "$(ulimit -Sn)" -lt $fds ]; then
+    ulimit -Sn $fds || fail "can't raise RLIMIT_NOFILE to $fds"
+fi
+sysctl -qw net.ipv4.ip_local_port_range="1024 65535" || fail "can't set net.ipv4.ip_local_port_range"
+sysctl -qw net.core.somaxconn=65535 || fail "can't raise net.core.somaxconn"
+sysctl -qw net.ipv4.tcp_max_syn_backlog=65535 || fail "can't raise net.ipv4.tcp_max_syn_backlog"
+
+# resident set size of process $1, in bytes
+rss() {
+    echo $(($(awk '/^VmRSS/ { print $2 }' /proc/$1/status) * 1024))
+}
+
+# the server's battle_clients gauge
+clients() {
+    curl -s localhost:$((port + 1)) | awk '/^battle_clients / { print $2 }'
+}
+
+# nobody names themselves or says anything, and nobody is dropped for it
+./battle -p $port -a $((port + 1)) -L 65535 -N $((2 * hold)) -I $((2 * hold)) -l warn &
+server=$!
+trap 'kill $server $bench 2>/dev/null; wait' EXIT
+sleep 1
+kill -0 $server 2>/dev/null || fail "battle didn't start"
+before=$(rss $server)
+
+./bench -p $port -i -c $n -d $hold &
+bench=$!
+held=0
+while kill -0 $bench 2>/dev/null; do
+    held=$(clients)
+    [ "${held:-0}" -ge $n ] && break
+    sleep 1
+done
+sleep 1
+after=$(rss $server)
+held=$(clients)
+kill $bench 2>/dev/null
+wait $bench 2>/dev/null
+bench=
+
+[ "${held:-0}" -ge $n ] || fail "the server held ${held:-0} of $n connections"
+each=$(((after - before) / n))
+echo "idletest: $n idle connections held, $((after - before)) bytes of RSS, $each bytes each (at most $max)"
+[ $each -le $max ] || fail "each connection costs $each bytes, over $max"
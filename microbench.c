@@ -0,0 +1,404 @@
+/*
+ * microbenchmarks for the battle server's hot paths:
+ * handleclient(), matchmake(), handle_games(), removeclient() and pushtoback(),
+ * each with 10, 1k, 10k and 100k clients (half as many games) on the shard.
+ *
+ * server.c is compiled in, so the functions run as they do in the server, on
+ * one shard with output digested as a replay does rather than sent. clients
+ * are known by made-up fds, except those handleclient() reads from, which get
+ * a socketpair each. every size runs in a child process of its own, so one
+ * size's pools and tables don't flatter the next.
+ *
+ * it prints one tab-separated line per benchmark and size: name, clients,
+ * ns/op (the best of a few batches) and heap allocations/op. given an earlier run's output with -b, it
+ * exits 1 if anything got more than -t percent slower or allocates more.
+*/
+
+#define main battlemain
+#include "server.c"
+#undef main
+
+#include <sys/wait.h>
+
+// the made-up fds start here, well clear of real ones
+#define FAKEFD (1 << 20)
+// at most this many clients are read from over socketpairs
+#define MAXPAIRS 4096
+// rounds are repeated until at least this many ops have been timed, in this many batches
+#define MINOPS 200000
+#define BATCHES 5
+
+// heap allocations so far: malloc(), calloc() and realloc() count them
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+long allocs;
+
+void* malloc(size_t size)
+{
+    allocs++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    allocs++;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size)
+{
+    allocs++;
+    return __libc_realloc(p, size);
+}
+
+// the clients on the shard, their fds and ratings to begin with, and the
+// peers of the ones with socketpairs
+struct client** bots;
+int* fds;
+int* ratings;
+int* peers;
+int npeers;
+// time (ns) and allocations inside timed sections, and when the current one began
+long elapsed;
+long allocated;
+long began;
+long allocsbegan;
+
+void timed(int on);
+void setup(struct clienttab* tab, int n);
+void reset(int n);
+void pairgames(int n, int mode);
+long bench_handleclient(struct clienttab* tab, int n);
+long bench_matchmake(struct clienttab* tab, int n);
+long bench_handle_games(struct clienttab* tab, int n);
+long bench_removeclient(struct clienttab* tab, int n);
+long bench_pushtoback(struct clienttab* tab, int n);
+void run(int bench, int n, char* line, int size);
+double baseline(const char* path, const char* name, int n, double* allocsop);
+
+// each benchmark runs one round with n clients and returns how many ops it timed
+static const struct {
+    const char* name;
+    long (*round)(struct clienttab* tab, int n);
+} benches[] = {
+    { "handleclient", bench_handleclient },
+    { "matchmake", bench_matchmake },
+    { "handle_games", bench_handle_games },
+    { "removeclient", bench_removeclient },
+    { "pushtoback", bench_pushtoback },
+};
+
+int main(int argc, char** argv)
+{
+    static const int sizes[] = { 10, 1000, 10000, 100000 };
+    const char* basepath = NULL;
+    double tolerance = 25, base, baseallocs, ns, allocsop;
+    char line[256];
+    int opt, i, j, maxsize = 100000, worse = 0;
+
+    while((opt = getopt(argc, argv, "n:b:t:")) != -1) {
+	switch(opt) {
+	case 'n': maxsize = atoi(optarg); break;
+	case 'b': basepath = optarg; break;
+	case 't': tolerance = atof(optarg); break;
+	default:
+	    fprintf(stderr, "usage: %s [-n most clients] [-b earlier output] [-t %% slower allowed]\n", argv[0]);
+	    exit(1);
+	}
+    }
+    for(i = 0; i < sizeof(templates) / sizeof(templates[0]); i++) {
+	tmplinit(templates[i].t, templates[i].fmt);
+    }
+    raisefdlimit();
+    printf("# benchmark\tclients\tns/op\tallocs/op\n");
+    for(i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+	for(j = 0; j < sizeof(sizes) / sizeof(sizes[0]) && sizes[j] <= maxsize; j++) {
+	    run(i, sizes[j], line, sizeof(line));
+	    fputs(line, stdout);
+	    fflush(stdout);
+	    if(!basepath || sscanf(line, "%*s %*d %lf %lf", &ns, &allocsop) != 2 ||
+		(base = baseline(basepath, benches[i].name, sizes[j], &baseallocs)) <= 0) {
+		continue;
+	    }
+	    if(ns > base * (1 + tolerance / 100) || allocsop > baseallocs + 0.005) {
+		fprintf(stderr, "%s with %d clients: %.1f ns/op and %.3f allocs/op, was %.1f and %.3f\n",
+		    benches[i].name, sizes[j], ns, allocsop, base, baseallocs);
+		worse = 1;
+	    }
+	}
+    }
+    return worse;
+}
+
+/* runs benchmark bench with n clients in a child process, and puts its result line in line */
+void run(int bench, int n, char* line, int size)
+{
+    int pfd[2], status, batch;
+    long ops, allops = 0, rounds;
+    double best = 0;
+    ssize_t len;
+    pid_t pid;
+    FILE* in;
+
+    if(pipe(pfd)) {
+	perror("pipe");
+	exit(1);
+    }
+    if((pid = fork()) < 0) {
+	perror("fork");
+	exit(1);
+    }
+    if(pid == 0) {
+	struct clienttab tab;
+	static struct shard sh;
+
+	close(pfd[0]);
+	self = shards = &sh;
+	nshards = 1;
+	loglevel = LOG_ERROR;
+	replaying = 1;
+	idletimeout = 10 * 60 * 1000;
+	turntimeout = 30 * 1000;
+	matchwindow = 100;
+	matchwiden = 50;
+	seed = 1;
+	poolinit(&sh.clientpool, 0, "client", sizeof(struct client));
+	poolinit(&sh.inpool, 0, "inbuf", INBUF);
+	poolinit(&sh.chunkpool, 0, "outchunk", sizeof(struct outchunk));
+	if(!(ipslots = calloc(IPSLOTS, sizeof(struct ipslot)))) {
+	    perror("calloc");
+	    exit(1);
+	}
+	tickms = now_ms();
+	wheelinit(tickms / TICKMS);
+	memset(&tab, 0, sizeof(tab));
+	memset(&games, 0, sizeof(games));
+	memset(&waiting, 0, sizeof(waiting));
+	setup(&tab, n);
+	// one round untimed first, so pools and tables have grown to size
+	benches[bench].round(&tab, n);
+	// the best of BATCHES batches, as anything else running only slows one down
+	allocated = 0;
+	for(batch = 0; batch < BATCHES; batch++) {
+	    elapsed = ops = 0;
+	    for(rounds = 0; ops < MINOPS / BATCHES || !rounds; rounds++) {
+		ops += benches[bench].round(&tab, n);
+	    }
+	    if(!batch || (double)elapsed / ops < best) {
+		best = (double)elapsed / ops;
+	    }
+	    allops += ops;
+	}
+	len = snprintf(line, size, "%s\t%d\t%.1f\t%.3f\n", benches[bench].name, n,
+	    best, (double)allocated / allops);
+	_exit(write(pfd[1], line, len) != len);
+    }
+    close(pfd[1]);
+    if(!(in = fdopen(pfd[0], "r"))) {
+	perror("fdopen");
+	exit(1);
+    }
+    if(!fgets(line, size, in)) {
+	snprintf(line, size, "# %s with %d clients failed\n", benches[bench].name, n);
+    }
+    fclose(in);
+    waitpid(pid, &status, 0);
+}
+
+/* starts or stops a timed section */
+void timed(int on)
+{
+    if(on) {
+	allocsbegan = allocs;
+	began = now_ns();
+    } else {
+	elapsed += now_ns() - began;
+	allocated += allocs - allocsbegan;
+    }
+}
+
+/* connects n named clients with ratings around RATINGSTART. the first of each
+ * pair of clients, up to MAXPAIRS of them, reads from a socketpair */
+void setup(struct clienttab* tab, int n)
+{
+    struct in_addr addr = { htonl(INADDR_LOOPBACK) };
+    char name[NAMELEN + 1];
+    int i, sv[2];
+
+    bots = malloc(n * sizeof(struct client*));
+    fds = malloc(n * sizeof(int));
+    ratings = malloc(n * sizeof(int));
+    peers = malloc(n * sizeof(int));
+    if(!bots || !fds || !ratings || !peers) {
+	perror("malloc");
+	exit(1);
+    }
+    for(i = 0; i < n; i++) {
+	int fd = FAKEFD + i;
+	if(i % 2 == 0 && npeers < MAXPAIRS) {
+	    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv)) {
+		perror("socketpair");
+		exit(1);
+	    }
+	    fd = sv[0];
+	    peers[npeers++] = sv[1];
+	}
+	bots[i] = addclient(tab, fds[i] = fd, addr);
+	sprintf(name, "bot%d", i);
+	setname(bots[i], name);
+	timerarm(bots[i], TIMER_IDLE, idletimeout);
+	ratings[i] = RATINGSTART - 500 + rand_r(&seed) % 1000;
+    }
+}
+
+/* puts every client back to having no game and not waiting, with its first
+ * rating, and throws away the output it got */
+void reset(int n)
+{
+    int i;
+
+    flushall();
+    memset(&waiting, 0, sizeof(waiting));
+    for(i = 0; i < n; i++) {
+	bots[i]->waiting = 0;
+	bots[i]->waitprev = bots[i]->waitnext = NULL;
+	bots[i]->curgame = -1;
+	bots[i]->lastplayed = NULL;
+	bots[i]->rating = ratings[i];
+    }
+    games.count = games.nfree = games.nready = 0;
+    if(games.cap) {
+	memset(games.readyat, 0xff, games.cap * sizeof(int));
+    }
+}
+
+/* starts a game in mode between each pair of clients, the first of them to move */
+void pairgames(int n, int mode)
+{
+    int i, g;
+
+    for(i = 0; i + 1 < n; i += 2) {
+	g = gamenew(&games);
+	gamestart(&games, g, (unsigned long)i * 2654435761u + 1);
+	games.turn[g] = 0;
+	games.players[0][g] = bots[i];
+	games.players[1][g] = bots[i + 1];
+	bots[i]->curgame = bots[i + 1]->curgame = g;
+	setmode(g, mode);
+    }
+}
+
+/* op: reading and acting on "a" from a player whose turn it is */
+long bench_handleclient(struct clienttab* tab, int n)
+{
+    int i;
+
+    reset(n);
+    pairgames(n, 4);
+    games.nready = 0;
+    for(i = 0; i < npeers; i++) {
+	if(write(peers[i], "a", 1) != 1) {
+	    perror("write");
+	    exit(1);
+	}
+    }
+    timed(1);
+    for(i = 0; i < npeers; i++) {
+	while(handleclient(bots[2 * i], tab) == 0)
+	    ;
+    }
+    timed(0);
+    return npeers;
+}
+
+/* op: pairing off one of n waiting players */
+long bench_matchmake(struct clienttab* tab, int n)
+{
+    int i;
+
+    reset(n);
+    for(i = 0; i < n; i++) {
+	pushtoback(&waiting, bots[i]);
+    }
+    timed(1);
+    matchmake(&waiting);
+    timed(0);
+    return n;
+}
+
+/* op: one attack in one of n / 2 games */
+long bench_handle_games(struct clienttab* tab, int n)
+{
+    reset(n);
+    pairgames(n, 1);
+    timed(1);
+    handle_games();
+    timed(0);
+    return n / 2;
+}
+
+/* op: one client leaving, half of them in the middle of a game. they go the way the
+ * server drops them: marked dead, then reaped after the flush, so nobody is freed
+ * while its opponent's forfeit has put it on flushlist */
+long bench_removeclient(struct clienttab* tab, int n)
+{
+    struct in_addr addr = { htonl(INADDR_LOOPBACK) };
+    int i;
+
+    reset(n);
+    pairgames(n, 4);
+    timed(1);
+    for(i = 0; i < n; i++) {
+	killclient(bots[i]);
+    }
+    flushall();
+    reapdead(tab, -1);
+    timed(0);
+    // the same clients again, on the same fds
+    for(i = 0; i < n; i++) {
+	char name[NAMELEN + 1];
+	bots[i] = addclient(tab, fds[i], addr);
+	sprintf(name, "bot%d", i);
+	setname(bots[i], name);
+	timerarm(bots[i], TIMER_IDLE, idletimeout);
+    }
+    return n;
+}
+
+/* op: one player joining the waiting queue */
+long bench_pushtoback(struct clienttab* tab, int n)
+{
+    int i;
+
+    reset(n);
+    timed(1);
+    for(i = 0; i < n; i++) {
+	pushtoback(&waiting, bots[i]);
+    }
+    timed(0);
+    return n;
+}
+
+/* ns/op for name with n clients in the output at path, and allocs/op in *allocsop; 0 if it isn't there */
+double baseline(const char* path, const char* name, int n, double* allocsop)
+{
+    FILE* in = fopen(path, "r");
+    char line[256], what[64];
+    double ns = 0;
+    int clients;
+
+    if(!in) {
+	perror(path);
+	exit(1);
+    }
+    while(fgets(line, sizeof(line), in)) {
+	if(sscanf(line, "%63s %d %lf %lf", what, &clients, &ns, allocsop) == 4 &&
+	    !strcmp(what, name) && clients == n) {
+	    fclose(in);
+	    return ns;
+	}
+    }
+    fclose(in);
+    return 0;
+}
@@ -7,290 +7,1554 @@
  * _or_ for a new connection.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <math.h>
 
 #ifndef PORT
 #define PORT 30100
 #endif
 
-struct game* games;
-// modified this to support games; noncanonical mode message typing
+// how many ready descriptors we pull out of epoll_wait per wakeup
+#define MAXEVENTS 256
+// payload bytes in one link of a client's output chain
+#define OUTCHUNK 1000
+// most iovecs handed to a single writev()
+#define MAXIOV 64
+// a client with more than this much unsent output is disconnected
+#define OUTLIMIT (64 * 1024)
+// bytes pulled off a socket per recv(); framed straight into curmessage
+#define INREAD 4096
+// the longest line or frame a client may have part way in, in a buffer borrowed from
+// the shard's inpool; a link frame (LINKHEAD + LINKDATA bytes) must fit
+#define INBUF 256
+// objects carved at once when a pool runs dry
+#define POOLSLAB 256
+// longest player name, not counting the terminating null
+#define NAMELEN 39
+// histograms keep 2^HSUBBITS linear buckets per power of two, so any value is within ~6%
+#define HSUBBITS 4
+#define HBUCKETS (64 << HSUBBITS)
+
+// metrics are written only by their own shard and read by the admin thread, so a
+// relaxed load and store is enough and the hot path never takes a locked instruction
+#define COUNT(c, n) atomic_store_explicit(&(c), atomic_load_explicit(&(c), memory_order_relaxed) + (n), memory_order_relaxed)
+#define GAUGE(g, v) atomic_store_explicit(&(g), (v), memory_order_relaxed)
+#define READ(c) atomic_load_explicit(&(c), memory_order_relaxed)
+
+// records per shard log ring; a power of two
+#define LOGRING 4096
+// most arguments a log record carries, and room for its string arguments
+#define LOGARGS 6
+#define LOGTEXT 64
+// how long the logger thread sleeps when every ring is empty (us)
+#define LOGIDLE 2000
+
+// timer wheel: WHEELLEVELS levels of 2^WHEELBITS slots, TICKMS per level-0 slot,
+// so deadlines up to 2^24 ticks (about 19 days) away are kept without a search
+#define WHEELBITS 6
+#define WHEELSLOTS (1 << WHEELBITS)
+#define WHEELLEVELS 4
+#define TICKMS 100
+
+// most pieces in a message template, iovecs in a message, and numbers in a message
+#define TMPLPIECES 12
+#define MSGIOV 32
+#define MSGNUMS 8
+
+// the most connections a shard accepts in one go; it takes the rest next iteration,
+// so a storm of connects can't hold up the games in progress
+#define ACCEPTBATCH 64
+// connections are counted by address in this many slots, hashed; a power of two
+#define IPSLOTS (1 << 16)
+
+// lobby announcements made in one tick go out together, as soon as this many bytes are pending
+#define LOBBYMAX 4096
+// a spectator with more than this much output pending misses battle events until it catches up
+#define WATCHLAG (16 * 1024)
+
+// games simulate() plays at once
+#define SIMLANES 4096
+
+// ratings (Elo): where every player starts, and the most one game moves them
+#define RATINGSTART 1500
+#define RATINGK 32
+// waiting players are kept in buckets RATINGSTEP rating points wide, one bit
+// of an unsigned long per bucket; ratings off either end share the end buckets
+#define RATINGSTEP 50
+#define RATINGBUCKETS 64
+
+// what a journal starts with, ahead of the seed of the shard that wrote it
+#define JMAGIC "BTJ1"
+// at most this long (ms) passes between journal flushes
+#define JFLUSHMS 1000
+
+// what a player stats file starts with, and how many players a new one holds;
+// its index has twice as many slots, so probes stay short. a power of two
+#define SMAGIC "BTS1"
+#define STATSCAP (1 << 20)
+
+// binary protocol: a client that answers "What is your name?" with BMAGIC instead
+// of a name sends and gets frames from then on. a frame is a length byte counting
+// the bytes after it, a type byte and a payload; a length of 0 is padding, and
+// numbers are big-endian. bench.c speaks it too, so the two must agree
+#define BMAGIC 0xb7
+// frames a client sends: its name; attack and powermove (no payload); something to say
+enum { B_NAME = 1, B_ATTACK, B_POWERMOVE, B_CHAT };
+// frames a client gets: named (no payload); the opponent's name; a move (who made it,
+// 1 if it was you, whether it was a powermove, damage done); a status snapshot
+// (your hp (16 bits) and powermoves, the opponent's, then 1 if it is your turn);
+// what the opponent said; game over (0 lost, 1 won, 2 won because the opponent
+// left); and a timeout (one of BT_*)
+enum { B_WELCOME = 0x81, B_ENGAGE, B_MOVE, B_STATUS, B_CHATFROM, B_OVER, B_TIMEOUT };
+enum { BT_NAME, BT_ATTACK, BT_FORFEIT, BT_IDLE };
+
+// what a hot restart snapshot starts with, and how many fds go in one message
+// (the kernel takes at most 253)
+#define HMAGIC "BTH1"
+#define HFDBATCH 250
+
+// a link between a gateway (-G) and a backend (-K) carries frames of a type byte,
+// a stream id (32 bits), a length byte and that many bytes of payload, so a frame
+// fits in curmessage; numbers are big-endian. a stream is one player the gateway
+// placed on the backend, named fd << 8 | a sequence byte, so a reused fd is a new stream
+#define LINKHEAD 6
+#define LINKDATA 250
+// a link with more than this much unsent output is broken off
+#define LINKLIMIT (4 * 1024 * 1024)
+// how often (ms) a backend reports its load, and how soon a gateway first retries
+// a backend it lost; each retry that fails doubles the wait, up to LINKMAXMS
+#define LOADMS 1000
+#define LINKMAXMS 32000
+// gateway to backend: a player (its rating (32 bits), 1 if it speaks the binary
+// protocol, its address, its name); start a game between the stream and the one in
+// the payload, which queued later; what the player sent; the player left.
+// backend to gateway: what the player is sent; the player's game is over (its new
+// rating (32 bits), then 1 if it is to be disconnected instead of queued again);
+// games in progress on the backend (32 bits); the backend wants no more games
+enum { L_OPEN = 1, L_PAIR, L_DATA, L_CLOSE, L_LOAD, L_DRAIN };
+
+// log levels; records below loglevel cost one comparison
+enum { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+// each shard's event loop has its own copy of everything below, so shards never contend
+__thread struct gametab games;
+__thread struct waitqueue waiting;
+// clients with output to send this tick, and clients to disconnect once the tick is over
+__thread struct client* flushlist;
+__thread struct client* deadlist;
+// state for rand_r(); each game's seed is drawn from its shard's sequence
+__thread unsigned int seed;
+// the shard's clock (ms, monotonic), read once as each tick starts so that
+// every timestamp and deadline in a tick agrees; replay sets it from the journal
+__thread long tickms;
+// set while a tick's socket events are handled, as opposed to its games and output
+__thread int inevents;
+// the shard this thread runs
+__thread struct shard* self;
+// set when the listener may have connections the last batch didn't take
+__thread int acceptpending;
+// when this shard last handed its unpaired players on
+__thread long handoffpass;
+__thread struct wheel wheel;
+// this tick's lobby announcements, not yet sent, and which batch they are
+__thread struct shared* lobby;
+__thread int lobbygen;
+// a gateway's link to each backend (NULL while there is none), when to try again to
+// make one it lacks and how long it waited last (0 once the backend is up), and the
+// sequence stream ids are drawn from
+__thread struct client** links;
+__thread long* linkretry;
+__thread long* linkdelay;
+__thread unsigned char streamseq;
+// links on this shard; on a backend, the players its gateways have here, when it
+// last reported its load, and whether its links have heard it is draining and it
+// has nothing left to do
+__thread int nlinks;
+__thread int nvirtual;
+__thread long loadsent;
+__thread int drainsent;
+__thread int drained;
+
+struct shard* shards;
+int nshards;
+// the port players connect to, and the one metrics are served on
+int listenport;
+int adminport;
+int loglevel;
+// how long (ms) a client gets to give its name, to make its move, and to say
+// anything at all; and whether a player who runs out of turn time forfeits
+// the game instead of attacking automatically
+long nametimeout;
+long turntimeout;
+long idletimeout;
+int forfeit;
+// who hears lobby announcements, and how many of them per batch (0 for no limit)
+enum { LOBBY_ALL, LOBBY_IDLE, LOBBY_WAITING };
+int lobbymode;
+int lobbycap;
+const char* lobbymodes[] = { "all", "idle", "waiting" };
+// how far apart (rating points) two players may be to be matched, and how much
+// further for each second the longer-waiting of them has waited
+long matchwindow;
+long matchwiden;
+// the listen backlog, and connection limits (0 for none): in all, and from one
+// address at once and per second
+int backlog;
+int maxconns;
+int maxperip;
+int maxrate;
+// connections open on every shard, and by address (see struct ipslot)
+_Atomic int connected;
+struct ipslot* ipslots;
+// the journal being written, if any, and when it was last flushed (tickms)
+FILE* journal;
+long journalflushed;
+// set when running a journal instead of serving; output is digested, not sent
+int replaying;
+unsigned long replaydigest;
+// the hot restart socket (-H), if any. restarting is set while a handover is
+// under way; parked and snapped count the shards that have stopped for it and
+// that have written out their state
+const char* restartpath;
+_Atomic int restarting;
+_Atomic int parked;
+_Atomic int snapped;
+// set when this process took over from another rather than starting afresh
+int resumed;
+int restartfd;
+// the admin listener, once there is one, so a handover can pass it on
+int adminfd = -1;
+// the backends a gateway places games on (-G), and the port a backend takes
+// gateway links on (-K; 0 if it is not one)
+struct sockaddr_in* backends;
+int nbackends;
+int linkport;
+// set by SIGUSR1 on a backend; shardsdrained counts the shards that are done since
+_Atomic int draining;
+_Atomic int shardsdrained;
+// stands in for a client in the epoll data of a shard's wakeup eventfd, and of its link listener
+struct client wakemark;
+struct client linkmark;
+// the player stats file, mapped: its header, index and records; NULL if there is none
+struct statshead* statsfile;
+_Atomic unsigned int* statsindex;
+struct pstats* statsrecs;
+// the record of every player who has none, so updating stats never checks
+struct pstats nostats;
+const char* levelnames[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+// a message template, split into literal text and holes once at startup:
+// %N is a client's name, %d an int, and %s a string followed by its length
+struct template {
+    int n;
+    struct piece {
+	const char* s;
+	int len;
+	// 0 for literal text, otherwise the directive letter
+	char hole;
+    } pieces[TMPLPIECES];
+};
+
+// output for one client being put together from templates. the iovecs point
+// at template text, names, and digits kept in nums, so nothing is copied
+// until queueoutv() appends it to the client's output chain
+struct msg {
+    struct iovec iov[MSGIOV];
+    int n;
+    char nums[MSGNUMS][12];
+    int nnums;
+};
+
+struct template t_engage, t_enters, t_welcome, t_chat, t_hit, t_gothit,
+    t_evaded, t_lost, t_won, t_status, t_waiting,
+    t_watch, t_shit, t_smiss, t_sstatus, t_sko, t_sleft;
+// every template and the text it is made from
+static const struct {
+    struct template* t;
+    const char* fmt;
+} templates[] = {
+    { &t_engage, "You engage %N!\r\n" },
+    { &t_enters, "\n**%N enters the arena...**\r\n" },
+    { &t_welcome, "Welcome, %N! Awaiting opponent...\r\n(w)atch a battle instead\r\n" },
+    { &t_chat, "\r\n%N takes a break to tell you: %s\r\n" },
+    { &t_hit, "You hit %N for %d damage!\r\n" },
+    { &t_gothit, "You got hit by %N for %d damage!\r\n" },
+    { &t_evaded, "You evaded %N!" },
+    { &t_lost, "\r\nYou are no match for %N. You got pwnt...\r\nFinding a new opponent...\r\n" },
+    { &t_won, "\r\n%N has surrendered. You win!\r\nFinding a new opponent...\r\n" },
+    { &t_status, "Your hitpoints: %d\r\nYour powermoves: %d \r\n\r\n%N's hitpoints: %d \r\n" },
+    { &t_waiting, "Waiting for %N to strike...\r\n" },
+    // what spectators see
+    { &t_watch, "\r\nNow watching %N vs %N. (w) for the next battle, (q) to find an opponent\r\n" },
+    { &t_shit, "%N hits %N for %d damage!\r\n" },
+    { &t_smiss, "%N's powermove misses %N!\r\n" },
+    { &t_sstatus, "%N: %d hp, %N: %d hp\r\n" },
+    { &t_sko, "%N knocks out %N! The battle is over.\r\n" },
+    { &t_sleft, "%N left the battle; %N wins. The battle is over.\r\n" },
+};
+
+// what a client's timer is waiting for
+enum { TIMER_NAME, TIMER_TURN, TIMER_IDLE, NTIMERS };
+
+// a deadline in the shard's timer wheel; linked into a slot while armed
+struct timer {
+    struct timer* next;
+    struct timer* prev;
+    // when it fires, in ticks
+    long expires;
+    int kind;
+};
+
+// hierarchical timing wheel: a timer lives at the lowest level whose span covers
+// its deadline and moves down a level each time the level below wraps around,
+// so arming, cancelling and firing are all O(1)
+struct wheel {
+    // the last tick processed
+    long now;
+    int count;
+    // circular list heads
+    struct timer slots[WHEELLEVELS][WHEELSLOTS];
+};
+
+// modified this to support games; noncanonical mode message typing.
+// this is all a connection costs while it is idle, so it is kept small: pointers
+// first, then the rest by size, and no buffers. input is borrowed from the shard's
+// inpool only while a line or frame is part way in, and output chunks only while
+// it is unsent, so an idle named player holds sizeof(struct client) (248 bytes on
+// x86-64) plus its pool header and its two table entries, 272 bytes in all, and the
+// kernel's socket and epoll entry besides
 struct client {
+    // links in the waiting queue, valid while waiting is set
+    struct client* waitprev;
+    struct client* waitnext;
+    // when this client joined the waiting queue (ms, monotonic clock)
+    long waitsince;
+    // output not yet accepted by the socket, oldest first
+    struct outchunk* outhead;
+    struct outchunk* outtail;
+    // link in flushlist, valid while flushing is set
+    struct client* flushnext;
+    union {
+	// link in deadlist; a dead client is ignored until it is reaped
+	struct client* deadnext;
+	// link in another shard's inbox while p is being handed over to it, which
+	// is never while it is dead
+	struct client* handoffnext;
+    };
+    // who this guy last played against; NULL if match not yet played or last played against player who left.
+    // the two always point at each other (see forget), so this never outlives the client it names
+    struct client* lastplayed;
+    // when this client last sent anything (ms, monotonic clock)
+    long lastinput;
+    // its one deadline: naming, its turn, or idling
+    struct timer timer;
+    // its links in the list of spectators of the game it is watching
+    struct client* watchprev;
+    struct client* watchnext;
+    // this player's record in the stats file, or nostats
+    struct pstats* stats;
+    // set if this client is a link to a gateway or backend; curmessage then holds a partial frame
+    struct linkstate* ls;
+    // a player in a game on a backend, on the gateway, or that game's player on the
+    // backend (with an fd of -1): the link it goes through and its stream on it
+    struct client* link;
+    // the line being typed, curlen bytes so far, in a buffer of INBUF bytes that is
+    // NULL while curlen is 0; this is all the input a connection holds between
+    // reads, however it arrives
+    char* curmessage;
     int fd;
-    // player name
-    char* name;
-    // buffer for storing current message (for noncanonical mode players)
-    char curmessage[256];
     struct in_addr ipaddr;
-    // what game this player is in (NULL for none)
-    struct game* curgame;
-    struct client* next;
-    // who this guy last played against; NULL if match not yet played or last played against player who left
-    struct client* lastplayed;
+    // what game this player is in (-1 for none)
+    int curgame;
+    // index of this client in clienttab.slots
+    int slot;
+    int outbytes;
+    // rating for this session
+    int rating;
+    // the game this client is watching instead of waiting (-1 for none)
+    int watching;
+    // where this client's own announcement sits in lobby batch lobbybatch, so it is spared it
+    int lobbybatch;
+    unsigned short lobbyat;
+    unsigned short lobbyend;
+    unsigned int stream;
+    short curlen;
+    // player name; empty until the client has answered "What is your name?"
+    char name[NAMELEN + 1];
+    unsigned char namelen;
+    // the waiting queue bucket rating put this client in
+    unsigned char waitbucket;
+    unsigned char waiting;
+    unsigned char flushing;
+    unsigned char dead;
+    // speaks the binary protocol (see BMAGIC); curmessage then holds a partial frame
+    unsigned char binary;
+    // on a backend: the game is over, so once its output is sent the player goes back to the gateway
+    unsigned char release;
+    // waiting, and passed over by every matchmake on this shard since the last handoff pass
+    unsigned char unpaired;
+};
+
+// one link of a client's output chain; data[off] .. data[len - 1] is unsent,
+// or ref->data[off] .. ref->data[len - 1] when the bytes are shared
+struct outchunk {
+    struct outchunk* next;
+    struct shared* ref;
+    int off;
+    int len;
+    char data[OUTCHUNK];
+};
+
+// bytes that many clients' output chains point at instead of copying. chunks
+// can follow a handed-off client to another shard, so the count is atomic and
+// whoever drops the last reference frees it
+struct shared {
+    _Atomic int refs;
+    int len;
+    char data[];
+};
+
+// every connected client, packed for iteration and indexed by fd for lookup;
+// insert, lookup and removal are all O(1)
+struct clienttab {
+    // byfd[fd] is the client on fd, or NULL
+    struct client** byfd;
+    int fdcap;
+    // slots[0] .. slots[count - 1] are the live clients, in no particular order
+    struct client** slots;
+    int count;
+    int cap;
+};
+
+// named players with no game, by rating: head[b] .. tail[b] are the players
+// rated within bucket b, oldest first, and bit b of nonempty says there are
+// some, so the nearest occupied bucket is a bit scan away. matchmake() pairs them off
+struct waitqueue {
+    struct client* head[RATINGBUCKETS];
+    struct client* tail[RATINGBUCKETS];
+    unsigned long nonempty;
+    int count;
+    // set when somebody joins, so the event loop knows a matchmake pass could pair them
+    int fresh;
+    // stats for the last matchmake pass that started a game
+    long lastwait;
+    long longestwait;
+};
+
+// a typed slab pool. objects are carved POOLSLAB at a time and recycled
+// through a freelist; slabs are never given back. only the owning shard
+// allocates from a pool, and objects freed by another shard come home through
+// the lock-free remote stack, so no pool is ever locked
+struct pool {
+    const char* what;
+    // id of the shard that owns this pool
+    int shard;
+    // bytes per object, header included
+    size_t size;
+    // free objects, linked through their first word; owner only
+    void* free;
+    // objects freed by other shards, newest first
+    void* _Atomic remote;
+    // live objects from this pool, the most there have ever been, and slabs carved;
+    // objects freed by other shards count as live until they are reclaimed
+    int inuse;
+    int highwater;
+    int slabs;
+};
+
+// HDR-style histogram: log-linear buckets, so recording is a shift and two adds
+struct histogram {
+    _Atomic long counts[HBUCKETS];
+    _Atomic long sum;
+};
+
+// why a connection was turned away: the server was full, or its address had
+// too many connections open or made too many this second
+enum { REJ_FULL, REJ_PERIP, REJ_RATE, NREJECTS };
+
+// connections open from the addresses hashed to one slot, and those attempted in
+// the current second, as (second << 24) | count. addresses sharing a slot share
+// its limits; with IPSLOTS slots that is rare, and nothing needs locking
+struct ipslot {
+    _Atomic int conns;
+    _Atomic unsigned long rate;
+};
+
+// what handleclient() was asked to do, for battle_commands_total
+enum { CMD_NAME, CMD_ATTACK, CMD_POWERMOVE, CMD_SPEAK, CMD_CHAT, CMD_WATCH, CMD_REJECTED, NCMDS };
+
+// one shard's counters, gauges and histograms; the admin thread adds up every shard's
+struct metrics {
+    _Atomic long accepts;
+    _Atomic long disconnects;
+    _Atomic long gamesstarted;
+    _Atomic long gamesfinished;
+    _Atomic long commands[NCMDS];
+    _Atomic long bytesin;
+    _Atomic long bytesout;
+    _Atomic long writefailures;
+    _Atomic long logdropped;
+    _Atomic long timeouts[NTIMERS];
+    _Atomic long timers;
+    _Atomic long lobbybatches;
+    _Atomic long lobbysends;
+    _Atomic long watchevents;
+    _Atomic long watchsends;
+    _Atomic long watchskips;
+    _Atomic long binaryclients;
+    _Atomic long rejected[NREJECTS];
+    _Atomic long shed;
+    _Atomic long gamesplaced;
+    // gauges, set once per event-loop iteration
+    _Atomic long clients;
+    _Atomic long waiting;
+    _Atomic long spectators;
+    _Atomic long links;
+    _Atomic long poolbytes;
+    // event-loop iteration (ns, excluding the wait), matchmake wait (ms), one game turn (ns)
+    struct histogram looptime;
+    struct histogram matchwait;
+    struct histogram turntime;
+    // rating points between paired players
+    struct histogram matchgap;
+};
+
+// one log line, not yet formatted. fmt must be a string literal; the logger
+// thread fills in its %d, %ld, %s, %a (a struct in_addr) and %e (an errno)
+// directives from args, and %s arguments are copied into text
+struct logrec {
+    long ns;
+    const char* fmt;
+    int level;
+    int shard;
+    long args[LOGARGS];
+    char text[LOGTEXT];
+};
+
+// single-producer, single-consumer ring of a shard's log records:
+// the shard advances head, the logger thread advances tail
+struct logring {
+    _Atomic unsigned long head;
+    _Atomic unsigned long tail;
+    struct logrec recs[LOGRING];
+};
+
+// one event loop, pinned to a thread: its own listener (SO_REUSEPORT), epoll set,
+// client table and games. the inbox is the only thing other shards touch
+struct shard {
+    int id;
+    pthread_t thread;
+    int listenfd;
+    // an fd held in reserve, given up to accept and close a connection when
+    // the process is out of fds
+    int sparefd;
+    int epfd;
+    // a backend's listener for gateway links (SO_REUSEPORT, like listenfd)
+    int linkfd;
+    // written by other shards after they push to inbox
+    int wakefd;
+    // waiting players handed over by other shards, newest first; a lock-free stack
+    struct client* _Atomic inbox;
+    // where this shard's clients, their input buffers and output chunks come from
+    struct pool clientpool;
+    struct pool inpool;
+    struct pool chunkpool;
+    struct metrics m;
+    struct logring log;
+    // this shard's part of a hot restart snapshot, and the client fds its
+    // records refer to, in order: written while handing over, read while resuming
+    char* snap;
+    size_t snaplen;
+    int* snapfds;
+    int nsnapfds;
+};
+
+// one end of a link between a gateway and a backend. the link is a client of its own,
+// so its frames go through the same output chain, flush and disconnect as anyone's
+struct linkstate {
+    // on a gateway, which of backends is at the other end; -1 on a backend
+    int backend;
+    // the backend has reported its load, and has said it is draining
+    int up;
+    int draining;
+    // games the backend last reported, and those placed on it since
+    int load;
+    // on a backend, the players the gateway has here, by the fd in their stream id
+    struct client** streams;
+    int cap;
+};
+
+// every game on a shard, as a structure of arrays: game g is entry g of each
+// column, so a batch of turns is resolved by walking a few dense arrays rather
+// than chasing pointers. ids are reused, so columns only grow to the most games
+// there have been at once
+struct gametab {
+    // modes: 0: waiting for attack, 1: attacking, 2: waiting for chat; 3 for powermove;
+    // 4: waiting for a command; 5: not a game (a free id)
+    unsigned char* mode;
+    // whose turn it is, 0 or 1, and each player's hitpoints and powermoves left
+    unsigned char* turn;
+    int* hp[2];
+    int* pm[2];
+    // each game's own random sequence (xorshift64*), so its rolls depend
+    // only on its seed and on its players' moves
+    unsigned long* rng;
+    struct client** players[2];
+    // where the game sits in ready, or -1 while it isn't there
+    int* readyat;
+    // games with something for handle_games() to do (modes 0, 1 and 3), in the
+    // order they became ready but for those moved into the place of a game taken
+    // out; games waiting on a player are never visited
+    int* ready;
+    int nready;
+    // the batch handle_games() is working through, what each game in it was
+    // doing, and the damage each one dealt
+    int* batch;
+    unsigned char* kind;
+    int* dealt;
+    // ids given back by finished games
+    int* freeids;
+    int nfree;
+    // the first of each game's spectators, linked through their watchnext,
+    // and how many clients are watching any game
+    struct client** watchers;
+    int nwatching;
+    // ids handed out so far, and room in every column
+    int count;
+    int cap;
+};
+
+// what a journal records: the start of a tick (payload: tickms), a connection
+// (payload: its struct in_addr), bytes read, a peer hanging up or failing a read,
+// and a client the network dropped after the tick's events (a failed or backed-up write)
+enum { J_TICK, J_ACCEPT, J_READ, J_CLOSE, J_DROP };
+
+// a journal starts with this
+struct jhead {
+    char magic[4];
+    unsigned int seed;
+};
+
+// then holds these, each followed by len bytes of payload
+struct jrec {
+    unsigned char type;
+    unsigned char pad;
+    unsigned short len;
+    int fd;
 };
 
-// linked list struct for managing games
-struct game {
-    struct client* players[2];
-    int turn; // 0 or 1
-    int powermoves[2];
+// one player's record in the stats file, a cache line long. whichever shard runs
+// a game updates its players' counts in place, with relaxed stores like the
+// metrics; two clients using one name on two shards at once can lose an update
+struct pstats {
+    char name[NAMELEN + 1];
+    _Atomic unsigned int wins;
+    // losses include forfeits: games lost by leaving, or by running out of time with -F
+    _Atomic unsigned int losses;
+    _Atomic unsigned int forfeits;
+    unsigned int pad;
+    _Atomic unsigned long damage;
+};
+
+// the start of a player stats file. then comes the index, 2 * cap slots each
+// holding 0 or a record number + 1, and from the next page, room for cap records.
+// the file is mapped rather than read, so opening it takes as long for a million
+// players as for none, and updates are stores to memory, not writes
+struct statshead {
+    char magic[4];
+    unsigned int recsize;
+    unsigned int cap;
+    // records handed out. a record is claimed, then filled in, then pointed at by
+    // the index, so a crash at any point leaves at worst a record nothing points at
+    _Atomic unsigned int count;
+};
+
+// a hot restart snapshot: this header, then each shard's part, then (over the
+// socket, not in len) the listeners, the admin listener if admin is set, and
+// every shard's client fds in turn
+struct hhead {
+    char magic[4];
+    int nshards;
+    int nfds;
+    int admin;
+    size_t len;
+};
+
+// a shard's part: this, its games (ngames of them, ids and all), its ready
+// queue, and its clients, waiting players first in the order they queued up.
+// clients are known by the fd they had, so games can say who plays them
+struct hshard {
+    size_t len;
+    int nclients;
+    int ngames;
+    int nready;
+    int maxfd;
+};
+
+struct hgame {
+    unsigned char mode;
+    unsigned char turn;
     int hp[2];
-    struct game* next;
-    // modes: 0: waiting for attack, 1: attacking, 2: waiting for chat; 3 for powermove
-    char mode;
+    int pm[2];
+    unsigned long rng;
+    int players[2];
 };
 
-static struct client* addclient(struct client* top, int fd, struct in_addr addr);
-static struct client* removeclient(struct client* top, int fd);
-//static void broadcast(struct client* top, char* s, int size);
-int handleclient(struct client* p, struct client* top);
-static struct game* matchmake(struct client* top, struct game* games);
-static void broadcast_most(struct client* p, char* s, int size, struct client* exclude);
-struct game * handle_games(struct game* top);
-struct game * removegame(struct game *top, struct game *rem);
-struct client *pushtoback(struct client *top, struct client *topush);
+// then curlen bytes of the line being typed and outbytes of unsent output
+struct hclient {
+    int fd;
+    struct in_addr ipaddr;
+    char name[NAMELEN + 1];
+    int namelen;
+    int curlen;
+    int outbytes;
+    int curgame;
+    int watching;
+    int waiting;
+    int lastplayed;
+    long waitsince;
+    long lastinput;
+    // the armed timer's kind (-1 for none) and when it fires, in ticks; the
+    // monotonic clock is the machine's, so deadlines carry over as they are
+    int timer;
+    long expires;
+    int rating;
+    int binary;
+};
+
+static struct client* addclient(struct clienttab* tab, int fd, struct in_addr addr);
+static void tabinsert(struct clienttab* tab, struct client* p);
+static void removeclient(struct clienttab* tab, struct client* p);
+//static void broadcast(struct clienttab* tab, char* s, int size);
+int handleclient(struct client* p, struct clienttab* tab);
+static void takeinput(struct client* p, struct clienttab* tab, const char* buf, int len);
+static void takeframes(struct client* p, struct clienttab* tab, const char* buf, int len);
+static void takeframe(struct client* p, struct clienttab* tab, int type, const char* payload, int n);
+static void takename(struct client* p, struct clienttab* tab, char* name);
+static void sendchat(struct client* from, struct client* to, const char* s, int len);
+static void queueframe(struct client* p, int type, const void* payload, int n);
+static void turnframes(struct client* p, int g, int x, int a, int kind, int d, int over);
+static void timeoutnote(struct client* p, int why, const char* s, int len);
+static struct client* welcome(struct clienttab* tab, int fd, struct in_addr addr);
+static void takeconnections(struct clienttab* tab);
+static int admission(struct in_addr addr);
+static void refuse(int fd, struct in_addr addr, int why);
+static void countconn(struct in_addr addr, int n);
+static void playtick(struct clienttab* tab);
+static void endtick(struct clienttab* tab);
+static void matchmake(struct waitqueue* q);
+static void lobbyadd(struct clienttab* tab, struct msg* m, struct client* p);
+static void lobbyflush(struct clienttab* tab);
+static void takewatch(struct client* p, char c);
+static void watch(struct client* p, int g);
+static void unwatch(struct client* p);
+static void forget(struct client* p);
+static void watchpost(int g, struct msg* m);
+void handle_games(void);
+void removegame(int g);
+static void gamegrow(struct gametab* t, int cap);
+int gamenew(struct gametab* t);
+void gamestart(struct gametab* t, int g, unsigned long seed);
+void battlepass(struct gametab* t, const int* ids, int n, int* dealt);
+void simulate(long battles);
+void pushtoback(struct waitqueue *q, struct client *topush);
+static void unwait(struct waitqueue *q, struct client *p);
+static void rate(struct client* winner, struct client* loser);
+void setmode(int g, char mode);
+void queueout(struct client *p, const char *s, int size);
+void queueoutv(struct client *p, const struct iovec *iov, int n);
+void queueref(struct client *p, struct shared *b, int off, int len);
+void sharedput(struct shared *b);
+static void chunkput(struct outchunk *c);
+static char *inbuf(struct client *p);
+static void inbufdone(struct client *p);
+void tmplinit(struct template* t, const char* fmt);
+void msgadd(struct msg* m, const struct template* t, ...);
+void msglit(struct msg* m, const char* s, int len);
+void msgsend(struct client* p, struct msg* m);
+void flushclient(struct client *p);
+void flushall(void);
+void killclient(struct client *p);
+static void dropclient(struct client *p);
+int reapdead(struct clienttab *tab, int epfd);
+static void unready(int g);
+static struct client* mover(int g);
+long now_ms(void);
+long now_ns(void);
+void hrecord(struct histogram* h, long v);
+void* runadmin(void* arg);
+void logmsg(int level, const char* fmt, ...);
+void* runlogger(void* arg);
+void* runshard(void* arg);
+void wheelinit(long now);
+void wheeladvance(long to);
+void timerarm(struct client* p, int kind, long ms);
+void timercancel(struct client* p);
+void poolinit(struct pool* pl, int shard, const char* what, size_t size);
+void* poolget(struct pool* pl);
+void poolput(void* obj);
+static long poolbytes(struct pool* pl);
+static void handoff(struct clienttab* tab, struct client* p, struct shard* to);
+static void takehandoffs(struct clienttab* tab);
+static void handunpaired(struct clienttab* tab);
+void journalput(int type, int fd, const void* data, int len);
+static unsigned long fnv(unsigned long h, const void* data, int len);
+void runreplay(struct shard* sh, const char* path);
+void statsopen(const char* path);
+struct pstats* statsfind(const char* name, int len);
+static void park(struct clienttab* tab);
+static void snapshot(struct clienttab* tab);
+static void resume(struct clienttab* tab);
+void* runrestart(void* arg);
+int takeover(const char* path);
+int restartlisten(const char* path);
+void backendsparse(char* list);
+static void linkup(struct clienttab* tab, int b);
+static void takelinks(struct clienttab* tab);
+static void makelink(struct client* p, int backend);
+static void linktick(struct clienttab* tab);
+static void linkput(struct client* link, int type, unsigned int stream, const void* payload, int n);
+static void linkdata(struct client* link, unsigned int stream, const char* buf, int len);
+static void linkclose(struct client* p);
+static void linkdown(struct clienttab* tab, struct client* link);
+static void takelink(struct client* link, struct clienttab* tab, const char* buf, int len);
+static void linkload(struct client* link);
+static int place(struct client* older, struct client* newer);
+static void requeue(struct client* p);
+static void logwait(void);
+void drain(int sig);
+
+int bindandlisten(int port);
+void watchfd(int epfd, int fd, struct client* data, unsigned int events);
+void raisefdlimit(void);
+
+int main(int argc, char** argv)
+{
+    int i, opt;
+    pthread_t admin, logger, restarter;
+
+    // -t sets how many shards (threads) to run; by default one per online core.
+    // -p sets the port players connect to, so several servers can run on one host.
+    // -a sets the port metrics are served on, on 127.0.0.1 only; 0 turns it off.
+    // -l sets the least severe log level written: debug, info, warn or error.
+    // -N, -T and -I set the name, turn and idle timeouts in seconds; -F makes
+    // running out of turn time forfeit the game.
+    // -b sends lobby announcements to all clients, only idle ones (not in a game)
+    // or only waiting players; -B caps how many get each batch, starting from a
+    // random client so that everyone hears some of them.
+    // -j journals every connection, read and hangup to a file, and runs a single
+    // shard so the journal holds the whole server; -r replays such a journal
+    // through the game engine, without sockets, as fast as it will go.
+    // -S plays that many battles with no server at all, and reports on them.
+    // -s keeps every player's wins, losses, forfeits and damage dealt in a file,
+    // made if need be; a replay never touches it.
+    // -w sets how far apart in rating two players may be and still be matched,
+    // and -W how many points further that reaches for each second they wait.
+    // -L sets the listen backlog. -C caps the connections open at once, -P those
+    // open from one address and -R those one address may make per second; a
+    // connection over a limit is told so and closed.
+    // -H listens on a Unix socket for a newer server to hand everything over to;
+    // started with the same -H, that newer server takes over from whoever is there.
+    // -G makes this server a gateway: the games it pairs are played on the backends
+    // listed (host:port,...), whichever has the fewest, or here if none will take
+    // them. -K makes it a backend, taking gateway links on that port; SIGUSR1 drains
+    // it: gateways are told to place no more games on it, and it exits once theirs are over
+    const char* journalpath = NULL;
+    const char* replaypath = NULL;
+    const char* statspath = NULL;
+    long simbattles = 0;
+    nshards = 0;
+    listenport = PORT;
+    adminport = PORT + 1;
+    loglevel = LOG_INFO;
+    nametimeout = 60 * 1000;
+    turntimeout = 30 * 1000;
+    idletimeout = 10 * 60 * 1000;
+    forfeit = 0;
+    lobbymode = LOBBY_ALL;
+    lobbycap = 0;
+    matchwindow = 100;
+    matchwiden = 50;
+    backlog = SOMAXCONN;
+    while((opt = getopt(argc, argv, "t:p:a:l:N:T:I:Fb:B:j:r:S:s:w:W:H:L:C:P:R:G:K:")) != -1) {
+	switch(opt) {
+	case 't':
+	    nshards = atoi(optarg);
+	    break;
+	case 'p':
+	    listenport = atoi(optarg);
+	    break;
+	case 'a':
+	    adminport = atoi(optarg);
+	    break;
+	case 'l':
+	    for(loglevel = LOG_ERROR; loglevel > LOG_DEBUG && strcasecmp(optarg, levelnames[loglevel]); loglevel--)
+		;
+	    break;
+	case 'N':
+	    nametimeout = atol(optarg) * 1000;
+	    break;
+	case 'T':
+	    turntimeout = atol(optarg) * 1000;
+	    break;
+	case 'I':
+	    idletimeout = atol(optarg) * 1000;
+	    break;
+	case 'F':
+	    forfeit = 1;
+	    break;
+	case 'b':
+	    for(lobbymode = LOBBY_WAITING; lobbymode > LOBBY_ALL && strcasecmp(optarg, lobbymodes[lobbymode]); lobbymode--)
+		;
+	    break;
+	case 'B':
+	    lobbycap = atoi(optarg);
+	    break;
+	case 'j':
+	    journalpath = optarg;
+	    break;
+	case 'r':
+	    replaypath = optarg;
+	    break;
+	case 'S':
+	    simbattles = atol(optarg);
+	    break;
+	case 's':
+	    statspath = optarg;
+	    break;
+	case 'w':
+	    matchwindow = atol(optarg);
+	    break;
+	case 'W':
+	    matchwiden = atol(optarg);
+	    break;
+	case 'H':
+	    restartpath = optarg;
+	    break;
+	case 'L':
+	    backlog = atoi(optarg);
+	    break;
+	case 'C':
+	    maxconns = atoi(optarg);
+	    break;
+	case 'P':
+	    maxperip = atoi(optarg);
+	    break;
+	case 'R':
+	    maxrate = atoi(optarg);
+	    break;
+	case 'G':
+	    backendsparse(optarg);
+	    break;
+	case 'K':
+	    linkport = atoi(optarg);
+	    break;
+	default:
+	    fprintf(stderr, "usage: %s [-t shards] [-p port] [-a admin port] [-l log level]\n"
+		"\t[-N name timeout] [-T turn timeout] [-I idle timeout] [-F]\n"
+		"\t[-b all|idle|waiting] [-B lobby fan-out] [-j journal | -r journal]\n"
+		"\t[-S battles] [-s stats file] [-w match window] [-W window widening]\n"
+		"\t[-H restart socket] [-L backlog] [-C max connections]\n"
+		"\t[-P max connections per address] [-R max connects per address per second]\n"
+		"\t[-G backend host:port,...] [-K gateway link port]\n", argv[0]);
+	    exit(1);
+	}
+    }
+    if(simbattles > 0) {
+	simulate(simbattles);
+	return 0;
+    }
+    if(journalpath || replaypath) {
+	// a journal can't be carried across a restart
+	if(restartpath) {
+	    fprintf(stderr, "%s: -H can't be used with -j or -r\n", argv[0]);
+	    exit(1);
+	}
+	nshards = 1;
+    }
+    // links are neither journaled nor carried across a restart, and a backend's
+    // players from a gateway are not passed on again
+    if((nbackends || linkport) && (restartpath || journalpath || replaypath || (nbackends && linkport))) {
+	fprintf(stderr, "%s: -G and -K can't be used together, or with -H, -j or -r\n", argv[0]);
+	exit(1);
+    }
+    if(nshards <= 0 && (nshards = sysconf(_SC_NPROCESSORS_ONLN)) <= 0) {
+	nshards = 1;
+    }
+    if(journalpath) {
+	if(!(journal = fopen(journalpath, "wb"))) {
+	    perror(journalpath);
+	    exit(1);
+	}
+	setvbuf(journal, NULL, _IOFBF, 1 << 16);
+    }
+    if(statspath && !replaypath) {
+	statsopen(statspath);
+    }
 
-int bindandlisten(void);
+    for(i = 0; i < sizeof(templates) / sizeof(templates[0]); i++) {
+	tmplinit(templates[i].t, templates[i].fmt);
+    }
+    // a peer vanishing mid-write is reported by writev(), not by killing the server
+    signal(SIGPIPE, SIG_IGN);
+    raisefdlimit();
+    // a server already running on the restart socket hands over its listeners,
+    // players and games, and the number of shards they are spread over
+    if(restartpath) {
+	resumed = takeover(restartpath);
+	restartfd = restartlisten(restartpath);
+    }
+    if(!resumed && !(shards = calloc(nshards, sizeof(struct shard)))) {
+	perror("calloc");
+	exit(1);
+    }
+    if(!(ipslots = calloc(IPSLOTS, sizeof(struct ipslot)))) {
+	perror("calloc");
+	exit(1);
+    }
+    // every listener is bound before any shard runs, so a bad port fails at once
+    for(i = 0; i < nshards; i++) {
+	struct shard* sh = &shards[i];
+	sh->id = i;
+	poolinit(&sh->clientpool, i, "client", sizeof(struct client));
+	poolinit(&sh->inpool, i, "inbuf", INBUF);
+	poolinit(&sh->chunkpool, i, "outchunk", sizeof(struct outchunk));
+	if(replaypath) {
+	    continue;
+	}
+	if(!resumed) {
+	    sh->listenfd = bindandlisten(listenport);
+	}
+	if((sh->sparefd = open("/dev/null", O_RDONLY)) < 0) {
+	    perror("/dev/null");
+	    exit(1);
+	}
+	if((sh->epfd = epoll_create1(0)) < 0) {
+	    perror("epoll_create1");
+	    exit(1);
+	}
+	if((sh->wakefd = eventfd(0, EFD_NONBLOCK)) < 0) {
+	    perror("eventfd");
+	    exit(1);
+	}
+	atomic_init(&sh->inbox, NULL);
+	// the listening socket is the only fd registered without a client
+	watchfd(sh->epfd, sh->listenfd, NULL, EPOLLIN);
+	watchfd(sh->epfd, sh->wakefd, &wakemark, EPOLLIN);
+	if(linkport) {
+	    sh->linkfd = bindandlisten(linkport);
+	    watchfd(sh->epfd, sh->linkfd, &linkmark, EPOLLIN);
+	}
+    }
+    logmsg(LOG_INFO, "running %d shards", nshards);
+    if((errno = pthread_create(&logger, NULL, runlogger, NULL))) {
+	perror("pthread_create");
+	exit(1);
+    }
+    if(replaypath) {
+	runreplay(&shards[0], replaypath);
+	logwait();
+	return 0;
+    }
+    if(linkport) {
+	signal(SIGUSR1, drain);
+    }
+    if(adminport && (errno = pthread_create(&admin, NULL, runadmin, NULL))) {
+	perror("pthread_create");
+	exit(1);
+    }
+    if(restartpath && (errno = pthread_create(&restarter, NULL, runrestart, NULL))) {
+	perror("pthread_create");
+	exit(1);
+    }
+    for(i = 1; i < nshards; i++) {
+	if((errno = pthread_create(&shards[i].thread, NULL, runshard, &shards[i]))) {
+	    perror("pthread_create");
+	    exit(1);
+	}
+    }
+    runshard(&shards[0]);
+    return 0;
+}
 
-int main(void)
+/* the event loop of shard arg; never returns.
+ * players are paired within a shard, and games never leave the shard they start on.
+ * players a shard can't pair for a tick are handed to the shard with the fewest games,
+ * where the leftovers of every shard meet */
+void* runshard(void* arg)
 {
-    int clientfd, maxfd, nready;
+    int nready;
     struct client* p;
-    struct client* head = NULL;
-    socklen_t len;
-    struct sockaddr_in q;
-    struct timeval tv;
-    fd_set allset;
-    fd_set rset;
+    struct clienttab clients;
+    struct epoll_event events[MAXEVENTS];
+    int timeout;
 
-    games = NULL;
+    self = arg;
+    tickms = now_ms();
+    wheelinit(tickms / TICKMS);
+    seed = time(NULL) ^ (self->id * 2654435761u);
+    if(journal) {
+	struct jhead h;
+	memcpy(h.magic, JMAGIC, sizeof(h.magic));
+	h.seed = seed;
+	fwrite(&h, sizeof(h), 1, journal);
+    }
+    memset(&games, 0, sizeof(games));
+    memset(&clients, 0, sizeof(clients));
+    memset(&waiting, 0, sizeof(waiting));
+    flushlist = deadlist = NULL;
+    if(self->snap) {
+	resume(&clients);
+    }
+    // each shard has its own link to every backend, made on its first iteration
+    if(nbackends && (!(links = calloc(nbackends, sizeof(struct client*)))
+	|| !(linkretry = calloc(nbackends, sizeof(long))) || !(linkdelay = calloc(nbackends, sizeof(long))))) {
+	perror("calloc");
+	exit(1);
+    }
+    loadsent = tickms - LOADMS;
 
     int i;
 
-    int listenfd = bindandlisten();
-    // initialize allset and add listenfd to the
-    // set of file descriptors passed into select
-    FD_ZERO(&allset);
-    FD_SET(listenfd, &allset);
-    // maxfd identifies how far into the set to search
-    maxfd = listenfd;
-
     while(1) {
-	// make a copy of the set before we pass it into select
-	rset = allset;
-	/* timeout in seconds (You may not need to use a timeout for
-	* your assignment)*/
-	tv.tv_sec = 10;
-	tv.tv_usec = 0; /* and microseconds */
-
-	nready = select(maxfd + 1, &rset, NULL, NULL, &tv);
-	if(nready == 0) {
-	    printf("No response from clients in %ld seconds\n", tv.tv_sec);
-	    continue;
+	// with no deadlines armed, epoll_wait blocks until something is ready;
+	// otherwise it wakes for the next tick of the wheel
+	timeout = -1;
+	if(wheel.count) {
+	    timeout = (wheel.now + 1) * TICKMS - now_ms();
+	    if(timeout < 0) {
+		timeout = 0;
+	    }
 	}
-
+	// links have their own schedule: load reports, and reconnecting to lost backends
+	if((nbackends || linkport) && (timeout < 0 || timeout > LOADMS)) {
+	    timeout = LOADMS;
+	}
+	// players freed by the last round of games get paired without waiting for more input
+	// so do connections left over from the last batch accepted
+	nready = epoll_wait(self->epfd, events, MAXEVENTS, waiting.fresh || acceptpending ? 0 : timeout);
 	if(nready == -1) {
-	    perror("select");
+	    if(errno != EINTR) {
+		logmsg(LOG_ERROR, "epoll_wait: %e", errno);
+	    }
 	    continue;
 	}
+	long loopstart = now_ns();
+	tickms = now_ms();
+	if(journal) {
+	    journalput(J_TICK, 0, &tickms, sizeof(tickms));
+	}
 
-	if(FD_ISSET(listenfd, &rset)) {
-	    printf("a new client is connecting\n");
-	    len = sizeof(q);
-	    if((clientfd = accept(listenfd, (struct sockaddr*)&q, &len)) < 0) {
-		perror("accept");
-		exit(1);
+	inevents = 1;
+	for(i = 0; i < nready; i++) {
+	    p = events[i].data.ptr;
+	    if(p == &wakemark) {
+		takehandoffs(&clients);
+		continue;
 	    }
-	    FD_SET(clientfd, &allset);
-	    if(clientfd > maxfd) {
-		maxfd = clientfd;
+	    if(p == &linkmark) {
+		takelinks(&clients);
+		continue;
 	    }
-	    printf("connection from %s\n", inet_ntoa(q.sin_addr));
-	    head = addclient(head, clientfd, q.sin_addr);
-	    if (write(head->fd, "What is your name?", sizeof("What is your name?")) == -1){
-			perror("write");
-			exit(1);
-		}
+	    if(!p) {
+		acceptpending = 1;
+		continue;
+	    }
+	    if(p->dead) {
+		continue;
+	    }
+	    // the socket has room again: send whatever is still queued this tick
+	    if(events[i].events & EPOLLOUT && p->outhead && !p->flushing) {
+		p->flushnext = flushlist;
+		flushlist = p;
+		p->flushing = 1;
+	    }
+	    if(!(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+		continue;
+	    }
+	    // edge-triggered: drain the socket, one read per handleclient call
+	    int result;
+	    while((result = handleclient(p, &clients)) == 0)
+		;
+	    if(result == -1) {
+		dropclient(p);
+	    }
+	}
+	if(acceptpending) {
+	    takeconnections(&clients);
+	}
+	inevents = 0;
+	linktick(&clients);
+	playtick(&clients);
+	endtick(&clients);
+	// those nobody here would pair with move on, once a tick; the flush list is empty, so they can
+	if(nshards > 1 && tickms - handoffpass >= TICKMS) {
+	    handunpaired(&clients);
+	    handoffpass = tickms;
+	}
+	GAUGE(self->m.clients, clients.count);
+	GAUGE(self->m.waiting, waiting.count);
+	GAUGE(self->m.timers, wheel.count);
+	GAUGE(self->m.spectators, games.nwatching);
+	GAUGE(self->m.links, nlinks);
+	GAUGE(self->m.poolbytes, poolbytes(&self->clientpool) + poolbytes(&self->inpool) + poolbytes(&self->chunkpool));
+	hrecord(&self->m.looptime, now_ns() - loopstart);
+	// a hot restart is under way: stop here, between ticks, with nothing in flight
+	if(atomic_load(&restarting)) {
+	    park(&clients);
 	}
+    }
+    return NULL;
+}
 
-	for(i = 0; i <= maxfd; i++) {
-	    if(FD_ISSET(i, &rset)) {
-		for(p = head; p != NULL; p = p->next) {
-		    if(p->fd == i) {
-			int result = handleclient(p, head);
-			if(result == -1) {
-			    int tmp_fd = p->fd;
-			    head = removeclient(head, p->fd);
-			    FD_CLR(tmp_fd, &allset);
-			    close(tmp_fd);
-			}
-			break;
-		    }
-		}
-	    }
+/* everything a tick does once its socket events are handled, short of sending output */
+static void playtick(struct clienttab* tab)
+{
+    // deadlines that passed may kick players, or move games along
+    wheeladvance(tickms / TICKMS);
+    // the lobby hears who arrived before anyone is told of a game this tick
+    lobbyflush(tab);
+    matchmake(&waiting);
+    handle_games();
+}
+
+/* one writev per client with output, then drop anyone who failed;
+ * their opponents' victory messages go out in the next round */
+static void endtick(struct clienttab* tab)
+{
+    do {
+	flushall();
+    } while(reapdead(tab, self->epfd));
+    if(journal && tickms - journalflushed >= JFLUSHMS) {
+	if(fflush(journal)) {
+	    logmsg(LOG_ERROR, "journal: %e, no longer journaling", errno);
+	    fclose(journal);
+	    journal = NULL;
 	}
-	games = matchmake(head, games);
-	games = handle_games(games);
-	head = pushtoback(head, head);
+	journalflushed = tickms;
     }
-    return 0;
 }
 
-/* set p -> name to name */
-int setname(struct client* p, char* name)
+/* register fd with the epoll set, edge-triggered for events; data is handed
+ * back untouched by epoll_wait (the client, or NULL for the listening socket) */
+void watchfd(int epfd, int fd, struct client* data, unsigned int events)
 {
-	//up to 40 bits for name
-    if (!(p->name = malloc(40))){
-		perror("malloc");
-		exit(1);
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events | EPOLLET;
+    ev.data.ptr = data;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+	perror("epoll_ctl");
+	exit(1);
+    }
+}
+
+/* lift the soft fd limit up to the hard limit so we can hold as many
+ * connections as the box allows, not just the default 1024 */
+void raisefdlimit(void)
+{
+    struct rlimit rl;
+
+    if(getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+	perror("getrlimit");
+	return;
+    }
+    if(rl.rlim_cur < rl.rlim_max) {
+	rl.rlim_cur = rl.rlim_max;
+	if(setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+	    perror("setrlimit");
 	}
-	p -> name[39] = '\0'; //set last char to null char to indicate end of string
-    strncpy(p->name, name, strlen(name));
-    int i = 0;
-	/* sets all newline and network newline chars to null terminator*/
-    while(p->name[i] != '\0') {
-		if(p->name[i] == '\r' || p->name[i] == '\n') {
-			p->name[i] = '\0';
-		}
-		i++;
     }
+}
+
+/* set p -> name to name, keeping at most NAMELEN characters */
+int setname(struct client* p, char* name)
+{
+    strncpy(p->name, name, NAMELEN);
+	p -> name[NAMELEN] = '\0'; //set last char to null char to indicate end of string
+    // measured once; every message naming p reuses it
+    p->namelen = strlen(p->name);
     return 0;
 }
 
-int handleclient(struct client* p, struct client* top)
+/* p typed command c at the start of a line on its turn; a game waiting for
+ * a command (mode 4) takes it straight away, without waiting for the newline */
+static void takecommand(struct client* p, char c)
 {
-    char buf[256];
-    char outbuf[512];
-    int len = read(p->fd, buf, sizeof(buf) - 1);
-    if(len > 0) {
-		buf[len] = '\0';
-		if(len == 1 && buf[0] != '\n' && buf[0] != '\r') {
-			int i = strlen(p->curmessage);
-			if(i + len < 255) {
-				//add to message buffer
-				p->curmessage[i] = buf[0];
-				p->curmessage[i + 1] = '\0';
-			} else {
-				//set last few chars to line termination and string termination
-				p->curmessage[253] = '\r';
-				p->curmessage[254] = '\n';
-				p->curmessage[255] = '\0';
-			}
-			if(p->name) {
-				/* If not in game, or in game and not your turn, delete chars typed from message buffer */
-				if(!p->curgame || (p->curgame && p->curgame->players[p->curgame->turn]->fd != p->fd)) {
-					printf("command rejected from %s!\n", p->name);
-					p -> curmessage[0] = '\0';
+    int g = p->curgame;
 
-				}
-				/* If in game, is your turn and game waiting for command, process and accept commands, reset message buffer */
-				else if(p->curgame && p->curgame->players[p->curgame->turn]->fd == p->fd && p->curgame->mode == 4) {
-					if(p->curmessage[0] == 'a') {
-						p->curgame->mode = 1;
-						p->curmessage[0] = '\0';
-					} else if(p->curmessage[0] == 's') {
-						p->curgame->mode = 2;
-						if (write(p -> fd, "\r\nSay something...\r\n",20) == -1){
-							perror("write");
-							exit(1);
-						}
-						p->curmessage[0] = '\0';
-						printf("%s\n", p -> curmessage);
-					} else if(p->curmessage[0] == 'p' && p->curgame->powermoves[p->curgame->turn]) {
-						p->curgame->mode = 3;
-						p->curmessage[0] = '\0';
-					} else {
-						p->curmessage[0] = '\0';
-					}
-				}
-			}
-		} else {
-			/* copy current message into message buffer */
-			strncpy(p->curmessage + strlen(p->curmessage), buf, len);
-			if(p->name) {
-				/* reject command; same conditions as above */
-				if(!p->curgame || (p->curgame && p->curgame->players[p->curgame->turn]->fd != p->fd)) {
-					printf("command rejected from %s!\n", p->name);
-					p->curmessage[0] = '\0';
-				}
-				/* accept commands, process (or not) based on first char in mesage buffer; reset message buffer */
-				else if(p->curgame && p->curgame->players[p->curgame->turn]->fd == p->fd && p->curgame->mode == 4) {
-					if(p->curmessage[0] == 'a') {
-							p->curgame->mode = 1;
-							p->curmessage[0] = '\0';
-					} else if(p->curmessage[0] == 's') {
-						p->curgame->mode = 2;
-						if(write(p -> fd, "\r\nSay something...\r\n",20) == -1){
-							perror("write");
-							exit(1);
-						}
-						p->curmessage[0] = '\0';
-						printf("%s\n", p -> curmessage);
-					} else if(p->curmessage[0] == 'p' && p->curgame->powermoves[p->curgame->turn]) {
-						p->curgame->mode = 3;
-						p->curmessage[0] = '\0';
-					} else {
-						p->curmessage[0] = '\0';
-					}
-				}
-				/* if p is in game and in chat mode, send message from message buffer for both players in game to see */
-				else if(p -> curgame && p->curgame->players[p->curgame->turn]->fd == p->fd && p->curgame->mode == 2) {
-					char msg[330];
-					sprintf(msg, "\r\n%s takes a break to tell you: %s\r\n", p->curgame->players[p->curgame->turn] -> name, p -> curmessage);
-					if (write(p -> curgame -> players[(p -> curgame -> turn + 1) % 2] -> fd, msg, strlen(msg)) == -1){
-						perror("write");
-						exit(1);
-					}
-					sprintf(msg, "\r\nYou say: %s", p -> curmessage);
-
-					p -> curgame -> mode = 0;
-					p -> curmessage[0] = '\0';
-				}
-			} 
-		/* name not yet set; not "in arena" */
-		else {
-			/* set up name, read of message buffer; limit name size to 40 chars */
-			p->curmessage[40] = '\0';
-			setname(p, p->curmessage);
-			/* broadcast and send to new client appropriate messages */
-			char welcome_msg[160];
-			sprintf(welcome_msg, "\n**%s enters the arena...**\r\n", p->name);
-			broadcast_most(top, welcome_msg, strlen(welcome_msg), p);
-			sprintf(welcome_msg, "Welcome, %s! Awaiting opponent...\r\n", p->name);
-			if (write(p->fd, welcome_msg, strlen(welcome_msg)) == -1){
-				perror("write");
-				exit(1);
-			}
-	    }
-	    p->curmessage[0] = '\0';
-	    return 0;
-		}
+    if(c == 'a') {
+		COUNT(self->m.commands[CMD_ATTACK], 1);
+		timerarm(p, TIMER_IDLE, idletimeout);
+		setmode(g, 1);
+    } else if(c == 's') {
+		COUNT(self->m.commands[CMD_SPEAK], 1);
+		setmode(g, 2);
+		queueout(p, "\r\nSay something...\r\n",20);
+    } else if(c == 'p' && games.pm[games.turn[g]][g]) {
+		COUNT(self->m.commands[CMD_POWERMOVE], 1);
+		timerarm(p, TIMER_IDLE, idletimeout);
+		setmode(g, 3);
+    }
+}
+
+/* p finished a line in curmessage: its name if it has none yet, or what it
+ * wants to say if its game is waiting for chat; anything else is dropped */
+static void takeline(struct client* p, struct clienttab* tab)
+{
+    int g = p->curgame;
+    int len = p->curlen;
+
+    p->curmessage[len] = '\0';
+    p->curlen = 0;
+	/* name not yet set; not "in arena" */
+    if(!p->name[0]) {
+		takename(p, tab, p->curmessage);
+    }
+	/* if p is in game and in chat mode, send message from message buffer for both players in game to see */
+    else if(g >= 0 && mover(g) == p && games.mode[g] == 2) {
+		COUNT(self->m.commands[CMD_CHAT], 1);
+		sendchat(p, games.players[!games.turn[g]][g], p->curmessage, len);
+		setmode(g, 0);
+    }
+}
+
+/* p, which has no name yet, gave name: it joins the waiting queue and the lobby hears of it */
+static void takename(struct client* p, struct clienttab* tab, char* name)
+{
+    struct msg m;
+
+    m.n = m.nnums = 0;
+    COUNT(self->m.commands[CMD_NAME], 1);
+    setname(p, name);
+    p->stats = statsfind(p->name, p->namelen);
+    timerarm(p, TIMER_IDLE, idletimeout);
+    pushtoback(&waiting, p);
+    /* announce to the lobby at the end of the tick and send to new client appropriate messages */
+    msgadd(&m, &t_enters, p);
+    lobbyadd(tab, &m, p);
+    if(p->binary) {
+	queueframe(p, B_WELCOME, NULL, 0);
+	return;
+    }
+    m.n = m.nnums = 0;
+    msgadd(&m, &t_welcome, p);
+    msgsend(p, &m);
+}
+
+/* passes on what from said to its opponent, in to's protocol */
+static void sendchat(struct client* from, struct client* to, const char* s, int len)
+{
+    struct msg m;
+
+    if(to->binary) {
+	queueframe(to, B_CHATFROM, s, len);
+	return;
+    }
+    m.n = m.nnums = 0;
+    msgadd(&m, &t_chat, from, s, len);
+    msgsend(to, &m);
+}
+
+/* handle one read's worth of input from p, journaling it first.
+ * returns -1 if p should be removed, 1 once p's socket has been drained, 0 otherwise */
+int handleclient(struct client* p, struct clienttab* tab)
+{
+    char buf[INREAD];
+    int len = recv(p->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if(len > 0) {
+	journalput(J_READ, p->fd, buf, len);
+	takeinput(p, tab, buf, len);
+	return 0;
     } else if(len == 0) {
 	// socket is closed
-	printf("Disconnect from %s\n", inet_ntoa(p->ipaddr));
-	sprintf(outbuf, "Goodbye %s\r\n", inet_ntoa(p->ipaddr));
-	//broadcast(top, outbuf, strlen(outbuf));
+	logmsg(LOG_INFO, "Disconnect from %a", p->ipaddr);
 	return -1;
-    } else { // shouldn't happen
-	perror("read");
+    } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+	// nothing left to read until epoll tells us otherwise
+	return 1;
+    } else { // shouldn't happen, but for a link to a backend that isn't up, which linkdown() reports
+	logmsg(p->ls && p->ls->backend >= 0 && !p->ls->up ? LOG_DEBUG : LOG_WARN, "read from %a: %e", p->ipaddr, errno);
 	return -1;
     }
-    return 0;
 }
 
-/* bind and listen, abort on error
+/* act on len bytes of input from p. bytes are framed as they arrive, so every
+ * line and command is acted on, whether the client sends a line at a time or
+ * a character at a time; nothing already seen is rescanned */
+static void takeinput(struct client* p, struct clienttab* tab, const char* buf, int len)
+{
+	/* skipline is set after a command character until the end of its line or of this read;
+	a character-mode client never ends its command lines, and its next keystroke is a new read */
+	int i, rejected = 0, skipline = 0;
+
+	COUNT(self->m.bytesin, len);
+	// checked when the idle timer fires, so input costs no timer work
+	p->lastinput = tickms;
+	if(p->ls) {
+		takelink(p, tab, buf, len);
+		return;
+	}
+	/* a gateway's player whose game is on a backend: it all goes there, as it came */
+	if(p->link && p->fd >= 0) {
+		linkdata(p->link, p->stream, buf, len);
+		return;
+	}
+	if(p->binary) {
+		takeframes(p, tab, buf, len);
+		return;
+	}
+	for(i = 0; i < len && !p->dead; i++) {
+		char c = buf[i];
+		/* the magic byte in place of a name: the rest is binary frames */
+		if(!p->name[0] && !p->curlen && (unsigned char)c == BMAGIC) {
+			COUNT(self->m.binaryclients, 1);
+			p->binary = 1;
+			takeframes(p, tab, buf + i + 1, len - i - 1);
+			return;
+		}
+		/* end of line; telnet may send \r\n or \r\0, and the empty lines between are ignored */
+		if(c == '\r' || c == '\n' || c == '\0') {
+			if(p->curlen) {
+				takeline(p, tab);
+			}
+			skipline = 0;
+			continue;
+		}
+		/* rest of a line whose first character was a command */
+		if(skipline) {
+			continue;
+		}
+		if(p->name[0]) {
+			int g = p->curgame;
+			/* a player waiting for an opponent may watch a battle instead */
+			if(g < 0 && (p->waiting || p->watching >= 0) && (c == 'w' || c == 'q')) {
+				takewatch(p, c);
+				skipline = 1;
+				continue;
+			}
+			/* If not in game, or in game and not your turn, drop the input */
+			if(g < 0 || mover(g) != p) {
+				rejected = 1;
+				continue;
+			}
+			/* If in game, is your turn and game waiting for command, the first char is the command */
+			if(games.mode[g] == 4) {
+				takecommand(p, c);
+				skipline = 1;
+				continue;
+			}
+			/* the game is still busy with p's last command */
+			if(games.mode[g] != 2) {
+				continue;
+			}
+		}
+		/* a line too long for curmessage is cut where it fills up */
+		inbuf(p)[p->curlen++] = c;
+		if(p->curlen == INBUF - 1) {
+			takeline(p, tab);
+		}
+	}
+	inbufdone(p);
+	if(rejected) {
+		COUNT(self->m.commands[CMD_REJECTED], 1);
+		logmsg(LOG_DEBUG, "command rejected from %s!", p->name);
+	}
+}
+
+/* act on len bytes of binary protocol input from p. frames are put together in
+ * curmessage as they arrive, however the reads split them; a frame is acted on
+ * as soon as its last byte is in */
+static void takeframes(struct client* p, struct clienttab* tab, const char* buf, int len)
+{
+	unsigned char* f = (unsigned char*)inbuf(p);
+	int n;
+
+	for(; len > 0 && !p->dead; buf += n, len -= n) {
+		n = 1;
+		if(!p->curlen && !buf[0]) {
+			continue;
+		}
+		/* the length byte, or as much of the rest of the frame as this read has */
+		if(p->curlen) {
+			n = 1 + f[0] - p->curlen;
+			n = n < len ? n : len;
+		}
+		memcpy(p->curmessage + p->curlen, buf, n);
+		p->curlen += n;
+		if(p->curlen == 1 + f[0]) {
+			p->curlen = 0;
+			takeframe(p, tab, f[1], p->curmessage + 2, f[0] - 1);
+		}
+	}
+	inbufdone(p);
+}
+
+/* p sent a frame of type with n bytes of payload; it means what the same
+ * thing typed would, and goes through the same game code */
+static void takeframe(struct client* p, struct clienttab* tab, int type, const char* payload, int n)
+{
+	int g = p->curgame;
+	char name[NAMELEN + 1];
+
+	if(type == B_NAME && !p->name[0] && n > 0 && payload[0]) {
+		n = n < NAMELEN ? n : NAMELEN;
+		memcpy(name, payload, n);
+		name[n] = '\0';
+		takename(p, tab, name);
+	} else if(g >= 0 && mover(g) == p && games.mode[g] == 4 && (type == B_ATTACK || type == B_POWERMOVE)) {
+		takecommand(p, type == B_ATTACK ? 'a' : 'p');
+	} else if(g >= 0 && mover(g) == p && games.mode[g] == 4 && type == B_CHAT) {
+		/* speaking and what is said, in one frame */
+		COUNT(self->m.commands[CMD_SPEAK], 1);
+		COUNT(self->m.commands[CMD_CHAT], 1);
+		sendchat(p, games.players[!games.turn[g]][g], payload, n);
+		setmode(g, 0);
+	} else {
+		COUNT(self->m.commands[CMD_REJECTED], 1);
+		logmsg(LOG_DEBUG, "frame %d rejected from fd %d", type, p->fd);
+	}
+}
+
+/* queues a binary protocol frame of type with n bytes of payload for p */
+static void queueframe(struct client* p, int type, const void* payload, int n)
+{
+	unsigned char h[2] = { n + 1, type };
+	struct iovec iov[2] = { { h, 2 }, { (void*)payload, n } };
+
+	queueoutv(p, iov, n ? 2 : 1);
+}
+
+/* bind to port and listen, abort on error
  * returns FD of listening socket
  */
-int bindandlisten(void)
+int bindandlisten(int port)
 {
     struct sockaddr_in r;
     int listenfd;
@@ -303,352 +1567,3229 @@ int bindandlisten(void)
     if((setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) {
 	perror("setsockopt");
     }
+    // every shard binds its own listener to the port; the kernel spreads connections between them
+    if((setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int))) == -1) {
+	perror("setsockopt");
+	exit(1);
+    }
     memset(&r, '\0', sizeof(r));
     r.sin_family = AF_INET;
     r.sin_addr.s_addr = INADDR_ANY;
-    r.sin_port = htons(PORT);
+    r.sin_port = htons(port);
 
     if(bind(listenfd, (struct sockaddr*)&r, sizeof r)) {
 	perror("bind");
 	exit(1);
     }
 
-    if(listen(listenfd, 5)) {
+    if(listen(listenfd, backlog)) {
 	perror("listen");
 	exit(1);
     }
+    // the listener is edge-triggered, so accept() has to be able to say EAGAIN
+    if(fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) == -1) {
+	perror("fcntl");
+	exit(1);
+    }
     return listenfd;
 }
 
-static struct client* addclient(struct client* top, int fd, struct in_addr addr)
+/* adds the client that just connected on fd and asks for its name */
+static struct client* welcome(struct clienttab* tab, int fd, struct in_addr addr)
 {
-    struct client* p = malloc(sizeof(struct client));
-    if(!p) {
-	perror("malloc");
-	exit(1);
-    }
-
-    printf("Adding client %s\n", inet_ntoa(addr));
+    struct client* p;
 
-    p->fd = fd;
-    p->ipaddr = addr;
-	//SETTING EVERYTHING NULL
-    p->name = NULL;
-    p->next = top;
-    p->lastplayed = NULL;
-    p->curgame = NULL;
-    int i;
-    for(i = 0; i < 256; i++) {
-	p->curmessage[i] = '\0';
-    }
-	//ADDED CODE ENDS HERE
-    top = p;
-    return top;
+    COUNT(self->m.accepts, 1);
+    countconn(addr, 1);
+    logmsg(LOG_INFO, "connection from %a", addr);
+    p = addclient(tab, fd, addr);
+    queueout(p, "What is your name?", sizeof("What is your name?"));
+    return p;
 }
 
-static struct client* removeclient(struct client* top, int fd)
+/* accepts up to ACCEPTBATCH of the connections waiting on the shard's listener,
+ * leaving acceptpending set if there may be more. one that would break a limit
+ * is told so and closed; when the process is out of fds, the backlog is shed */
+static void takeconnections(struct clienttab* tab)
 {
-    struct client** p;
+    struct sockaddr_in q;
+    socklen_t len;
+    struct client* p;
+    int i, fd, why, shed = 0;
 
-    for(p = &top; *p && (*p)->fd != fd; p = &(*p)->next)
-	;
-    // Now, p points to (1) top, or (2) a pointer to another client
-    // This avoids a special case for removing the head of the list
-    if(*p) {
-		struct client* t = (*p)->next;
-		printf("Removing client %d %s\n", fd, inet_ntoa((*p)->ipaddr));
-		// free p's name if p had one; name was malloc'd
-		if ((*p) -> name){
-			free((*p) -> name);
-			(*p) -> name = NULL;
-		}
-		// end p's game, give victory message to p's opponent, delete game, set p's opponent to be recognized by matchmake function
-		if ((*p) -> curgame){
-			struct game * tofree = (*p) -> curgame;
-			(*p) -> curgame -> players[0] -> lastplayed = NULL;
-			(*p) -> curgame -> players[1] -> lastplayed = NULL;
-			if((*p) -> curgame -> players[0] == (*p)) {
-				if (write((*p) -> curgame -> players[1] -> fd, "Your opponent is a coward and left the game. You win!\r\nfinding a new opponent...\r\n",83) == -1){
-					perror("write");
-					exit(1);
-				}
-				(*p) -> curgame -> players[1] -> curgame = NULL;
-			}
-			else{
-				if (write((*p) -> curgame -> players[0] -> fd, "Your opponent is a coward and left the game. You win!\r\nfinding a new opponent...\r\n",83) == -1){
-					perror("write");
-					exit(1);
-				}
-				(*p) -> curgame -> players[0] -> curgame = NULL;
-			}
-			games = removegame(games, tofree);
+    acceptpending = 0;
+    // a spare fd that could not be reopened last time is tried again
+    if(self->sparefd < 0) {
+	self->sparefd = open("/dev/null", O_RDONLY);
+    }
+    for(i = 0; i < ACCEPTBATCH; i++) {
+	len = sizeof(q);
+	if((fd = accept4(self->listenfd, (struct sockaddr*)&q, &len, SOCK_NONBLOCK)) < 0) {
+	    if(errno == EAGAIN || errno == EWOULDBLOCK) {
+		return;
+	    }
+	    // edge-triggered, a backlog left alone would never be reported again,
+	    // so the spare fd makes room to take each connection and close it
+	    if(errno == EMFILE || errno == ENFILE) {
+		if(self->sparefd < 0) {
+		    // nothing to make room with: try again next tick, when fds may have been freed
+		    acceptpending = 1;
+		    break;
 		}
-		free(*p);
-		*p = t;
-    } else {
-		fprintf(stderr, "Trying to remove fd %d, but I don't know about it\n", fd);
+		close(self->sparefd);
+		if((fd = accept(self->listenfd, NULL, NULL)) >= 0) {
+		    close(fd);
+		    shed++;
+		}
+		self->sparefd = open("/dev/null", O_RDONLY);
+		continue;
+	    }
+	    // the connection was gone before it was taken
+	    if(errno == ECONNABORTED || errno == EPROTO || errno == EPERM || errno == EINTR) {
+		continue;
+	    }
+	    logmsg(LOG_ERROR, "accept: %e", errno);
+	    break;
+	}
+	if((why = admission(q.sin_addr)) >= 0) {
+	    refuse(fd, q.sin_addr, why);
+	    continue;
+	}
+	journalput(J_ACCEPT, fd, &q.sin_addr, sizeof(q.sin_addr));
+	p = welcome(tab, fd, q.sin_addr);
+	watchfd(self->epfd, fd, p, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+    }
+    if(i == ACCEPTBATCH) {
+	acceptpending = 1;
+    }
+    if(shed) {
+	COUNT(self->m.shed, shed);
+	logmsg(LOG_WARN, "out of fds, shed %d connections", shed);
     }
-    return top;
 }
 
-/* not used in assignment, but included in sample server
-static void broadcast(struct client* top, char* s, int size)
+/* the slot addr's connections are counted in */
+static struct ipslot* ipfor(struct in_addr addr)
 {
-    struct client* p;
-    for(p = top; p; p = p->next) {
-		if (write(p->fd, s, size) == -1){
-			perror("write");
-			exit(1);
+    return &ipslots[fnv(14695981039346656037UL, &addr, sizeof(addr)) & (IPSLOTS - 1)];
+}
+
+/* why a connection from addr must be turned away (REJ_*), or -1 if it may stay.
+ * every attempt counts towards the rate, refused or not. limits are checked here
+ * and counted in welcome(), so shards accepting at once can overshoot by one each */
+static int admission(struct in_addr addr)
+{
+    struct ipslot* ip = ipfor(addr);
+    unsigned long sec = tickms / 1000, old, n = 0;
+
+    if(maxrate) {
+	old = atomic_load_explicit(&ip->rate, memory_order_relaxed);
+	do {
+	    n = (old >> 24 == sec ? old & 0xffffff : 0) + 1;
+	    n = n < 0xffffff ? n : 0xffffff;
+	} while(!atomic_compare_exchange_weak_explicit(&ip->rate, &old, sec << 24 | n,
+	    memory_order_relaxed, memory_order_relaxed));
+    }
+    if(maxconns && READ(connected) >= maxconns) {
+	return REJ_FULL;
+    }
+    if(maxperip && READ(ip->conns) >= maxperip) {
+	return REJ_PERIP;
+    }
+    if(maxrate && n > maxrate) {
+	return REJ_RATE;
+    }
+    return -1;
+}
+
+/* tells the connection on fd, from addr, why it is being turned away, if its
+ * socket has room, and closes it */
+static void refuse(int fd, struct in_addr addr, int why)
+{
+    static const char* reasons[NREJECTS] = {
+	"The arena is full. Try again later.\r\n",
+	"Too many connections from your address. Try again later.\r\n",
+	"Too many connections from your address. Try again later.\r\n",
+    };
+
+    COUNT(self->m.rejected[why], 1);
+    logmsg(LOG_DEBUG, "turned away %a", addr);
+    send(fd, reasons[why], strlen(reasons[why]), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+}
+
+/* adds n to the connections open, in all and from addr */
+static void countconn(struct in_addr addr, int n)
+{
+    atomic_fetch_add_explicit(&connected, n, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ipfor(addr)->conns, n, memory_order_relaxed);
+}
+
+static struct client* addclient(struct clienttab* tab, int fd, struct in_addr addr)
+{
+    struct client* p = poolget(&self->clientpool);
+
+    p->fd = fd;
+    p->ipaddr = addr;
+	//SETTING EVERYTHING NULL
+    p->name[0] = '\0';
+    p->lastplayed = NULL;
+    p->curgame = -1;
+    p->waitprev = p->waitnext = NULL;
+    p->waiting = 0;
+    p->outhead = p->outtail = NULL;
+    p->outbytes = 0;
+    p->flushing = 0;
+    p->dead = 0;
+    p->curmessage = NULL;
+    p->curlen = 0;
+    p->lastinput = tickms;
+    p->timer.next = NULL;
+    p->lobbybatch = 0;
+    p->stats = &nostats;
+    p->rating = RATINGSTART;
+    p->watching = -1;
+    p->binary = 0;
+    p->ls = NULL;
+    p->link = NULL;
+    p->release = 0;
+    timerarm(p, TIMER_NAME, nametimeout);
+	//ADDED CODE ENDS HERE
+    tabinsert(tab, p);
+    return p;
+}
+
+/* index p by its fd and give it a slot, growing both arrays by doubling as needed.
+ * a backend's player from a gateway has no fd, and only a slot */
+static void tabinsert(struct clienttab* tab, struct client* p)
+{
+    int fd = p->fd;
+
+    if(fd >= 0 && fd >= tab->fdcap) {
+	int newcap = tab->fdcap ? tab->fdcap : 64;
+	while(newcap <= fd) {
+	    newcap *= 2;
+	}
+	struct client** byfd = realloc(tab->byfd, newcap * sizeof(struct client*));
+	if(!byfd) {
+	    perror("realloc");
+	    exit(1);
+	}
+	memset(byfd + tab->fdcap, 0, (newcap - tab->fdcap) * sizeof(struct client*));
+	tab->byfd = byfd;
+	tab->fdcap = newcap;
+    }
+    if(tab->count == tab->cap) {
+	int newcap = tab->cap ? tab->cap * 2 : 64;
+	struct client** slots = realloc(tab->slots, newcap * sizeof(struct client*));
+	if(!slots) {
+	    perror("realloc");
+	    exit(1);
+	}
+	tab->slots = slots;
+	tab->cap = newcap;
+    }
+    if(fd >= 0) {
+	tab->byfd[fd] = p;
+    }
+    p->slot = tab->count;
+    tab->slots[tab->count++] = p;
+}
+
+/* unlink p from the slot array by moving the last client into its slot */
+static void dropslot(struct clienttab* tab, struct client* p)
+{
+    struct client* last = tab->slots[--tab->count];
+    tab->slots[p->slot] = last;
+    last->slot = p->slot;
+}
+
+static void removeclient(struct clienttab* tab, struct client* p)
+{
+	// a link to a backend that never came up is reported by linkdown() alone
+	logmsg(p->ls && p->ls->backend >= 0 && !p->ls->up ? LOG_DEBUG : LOG_INFO, "Removing client %d %a", p->fd, p->ipaddr);
+	// links, and a backend's players from a gateway, were never counted
+	if (p -> fd >= 0 && !p -> ls){
+		countconn(p->ipaddr, -1);
+	}
+	if (p -> fd < 0){
+		nvirtual--;
+	}
+	timercancel(p);
+	if (p -> waiting){
+		unwait(&waiting, p);
+	}
+	if (p -> watching >= 0){
+		unwatch(p);
+	}
+	// p's last opponent, in this game or a finished one, is free to be paired with anyone
+	forget(p);
+	// end p's game, give victory message to p's opponent, delete game
+	if (p -> curgame >= 0){
+		int g = p -> curgame;
+		struct client *winner = games.players[games.players[0][g] == p][g];
+		if (winner -> binary){
+			unsigned char won = 2;
+			queueframe(winner, B_OVER, &won, 1);
+		}
+		else{
+			queueout(winner, "Your opponent is a coward and left the game. You win!\r\nfinding a new opponent...\r\n",83);
+		}
+		COUNT(winner -> stats -> wins, 1);
+		COUNT(p -> stats -> losses, 1);
+		COUNT(p -> stats -> forfeits, 1);
+		rate(winner, p);
+		if (games.watchers[g]){
+			struct msg m;
+			m.n = m.nnums = 0;
+			msgadd(&m, &t_sleft, p, winner);
+			watchpost(g, &m);
 		}
+		winner -> curgame = -1;
+		requeue(winner);
+		removegame(g);
+	}
+	// a link takes its players with it; a player on one says it is gone
+	if (p -> ls){
+		linkdown(tab, p);
+	}
+	else if (p -> link){
+		linkclose(p);
+	}
+	while (p -> outhead){
+		struct outchunk *c = p -> outhead;
+		p -> outhead = c -> next;
+		chunkput(c);
+	}
+	if (p -> curmessage){
+		poolput(p -> curmessage);
+	}
+	if (p -> fd >= 0){
+		tab->byfd[p->fd] = NULL;
+	}
+	dropslot(tab, p);
+	poolput(p);
+}
+
+/* not used in assignment, but included in sample server
+static void broadcast(struct clienttab* tab, char* s, int size)
+{
+    int i;
+    for(i = 0; i < tab->count; i++) {
+		queueout(tab->slots[i], s, size);
     }
-    should probably check write() return value and perhaps remove client
 }
 */
 
-/* broadcast function from the starter code, except sending messages to everybody but client exclude */
-static void broadcast_most(struct client* top, char* s, int size, struct client* exclude)
+/* adds message m to this tick's lobby announcements; p, who made it, is spared it.
+ * a batch that m would overflow is sent first, so no batch outgrows LOBBYMAX */
+static void lobbyadd(struct clienttab* tab, struct msg* m, struct client* p)
+{
+    int i, size = 0;
+
+    for(i = 0; i < m->n; i++) {
+	size += m->iov[i].iov_len;
+    }
+    if(lobby && lobby->len + size > LOBBYMAX) {
+	lobbyflush(tab);
+    }
+    if(!lobby) {
+	// the batch holds one reference of its own until lobbyflush lets go
+	if(!(lobby = malloc(sizeof(struct shared) + LOBBYMAX))) {
+	    perror("malloc");
+	    exit(1);
+	}
+	atomic_init(&lobby->refs, 1);
+	lobby->len = 0;
+	lobbygen++;
+    }
+    p->lobbybatch = lobbygen;
+    p->lobbyat = lobby->len;
+    for(i = 0; i < m->n && lobby->len + m->iov[i].iov_len <= LOBBYMAX; i++) {
+	memcpy(lobby->data + lobby->len, m->iov[i].iov_base, m->iov[i].iov_len);
+	lobby->len += m->iov[i].iov_len;
+    }
+    p->lobbyend = lobby->len;
+}
+
+/* queues lobby batch b for p, less p's own announcement; returns 0 if that left nothing */
+static int lobbysend(struct client* p, struct shared* b)
+{
+    // the lobby is text; binary clients are not told about it, and neither are
+    // links or players in a game on a backend, which is not their lobby
+    if(p->binary || p->ls || p->link) {
+	return 0;
+    }
+    if(p->lobbybatch != lobbygen) {
+	queueref(p, b, 0, b->len);
+	return 1;
+    }
+    queueref(p, b, 0, p->lobbyat);
+    queueref(p, b, p->lobbyend, b->len);
+    return p->lobbyat > 0 || p->lobbyend < b->len;
+}
+
+/* sends this tick's lobby announcements to the clients lobbymode picks, at most
+ * lobbycap of them if it is set. every recipient's output chain points at the
+ * one buffer, so a join storm costs a chunk per client per batch, not a copy
+ * (or a write) per client per join */
+static void lobbyflush(struct clienttab* tab)
 {
+    struct shared* b = lobby;
     struct client* p;
-    for(p = top; p; p = p->next) {
-		if(p != exclude) {
-			if (write(p->fd, s, size) == -1){
-				perror("write");
-				exit(1);
-			}
-		}
+    unsigned long bits;
+    int i, n, sent = 0;
+
+    if(!b) {
+	return;
+    }
+    lobby = NULL;
+    if(lobbymode == LOBBY_WAITING) {
+	for(bits = waiting.nonempty; bits && (!lobbycap || sent < lobbycap); bits &= bits - 1) {
+	    for(p = waiting.head[__builtin_ctzl(bits)]; p && (!lobbycap || sent < lobbycap); p = p->waitnext) {
+		sent += lobbysend(p, b);
+	    }
+	}
+    } else if(tab->count) {
+	// a capped batch starts at a random slot, so over time everyone hears some
+	i = lobbycap ? rand_r(&seed) % tab->count : 0;
+	for(n = 0; n < tab->count && (!lobbycap || sent < lobbycap); n++) {
+	    p = tab->slots[i];
+	    if(lobbymode == LOBBY_ALL || p->curgame < 0) {
+		sent += lobbysend(p, b);
+	    }
+	    i = i + 1 < tab->count ? i + 1 : 0;
+	}
     }
-    /* should probably check write() return value and perhaps remove client */
+    COUNT(self->m.lobbybatches, 1);
+    COUNT(self->m.lobbysends, sent);
+    sharedput(b);
 }
 
-/* searches through all clients to see if they've joined a game or not, and joins a pair of waiting clients together
- returns new head of games */
-static struct game* matchmake(struct client* top, struct game* games)
+/* the player whose turn it is in game g */
+static struct client* mover(int g)
 {
-    struct client* iteration = top;
-    struct client* newplayers[2];
-	//making sure both pointers are null in case garbage values are in memory
-    newplayers[0] = NULL;
-    newplayers[1] = NULL;
-    while(iteration) {
-		//if name set and not in game
-		if(!iteration->curgame && iteration->name) {
-			//if player 1 not yet found, keep track of iteration as player 1
-			if(!newplayers[0]) {
-				newplayers[0] = iteration;
-			}
-			// if player1 has been found, this will be player 2
-			// create new game, set all variables of new game, send start game messages
-			else if(!newplayers[1] && iteration->lastplayed != newplayers[0]) {
-				newplayers[1] = iteration;
-				struct game* newgame = malloc(sizeof(struct game));
-				if (!newgame){
-					perror("malloc");
-					exit(1);
-				}
-				newgame->players[0] = newplayers[0];
-				newgame->players[1] = newplayers[1];
-				newgame->players[0]->lastplayed = newplayers[1];
-				newgame->players[1]->lastplayed = newplayers[0];
-				newgame->turn = rand() % 2;
-				newgame->next = games;
-				newgame->mode = 0;
-				newgame->hp[0] = rand() % 11 + 20;
-				newgame->hp[1] = rand() % 11 + 20;
-				newgame->powermoves[0] = rand() % 2 + 1;
-				newgame->powermoves[1] = rand() % 2 + 1;
-				newplayers[0]->curgame = newgame;
-				newplayers[1]->curgame = newgame;
-				char msg[256];
-				sprintf(msg, "You engage %s!\r\n", newplayers[0]->name);
-				if (write(newplayers[1]->fd, msg, strlen(msg)) == -1){
-					perror("write");
-					exit(1);
-				}
-				sprintf(msg, "You engage %s!\r\nY", newplayers[1]->name);
-				if (write(newplayers[0]->fd, msg, strlen(msg)) == -1){
-					perror("write");
-					exit(1);
-				}
-				games = newgame;
-				return games;
-			}
+    return games.players[games.turn[g]][g];
+}
+
+/* clears p's lastplayed and its opponent's, which points back at p. called as p starts
+ * another game, leaves, or moves to another shard, so no client keeps a pointer to one
+ * that has been freed, recycled or handed to another thread */
+static void forget(struct client* p)
+{
+    if(p->lastplayed) {
+	p->lastplayed->lastplayed = NULL;
+	p->lastplayed = NULL;
+    }
+}
+
+/* starts a game between waiting players older and newer, older having waited longer */
+static void pairup(struct waitqueue* q, struct client* older, struct client* newer)
+{
+	struct msg m;
+	int i;
+
+	q->lastwait = tickms - older->waitsince;
+	hrecord(&self->m.matchwait, q->lastwait);
+	hrecord(&self->m.matchgap, abs(older->rating - newer->rating));
+	if(q->lastwait > q->longestwait) {
+		q->longestwait = q->lastwait;
+	}
+	unwait(q, older);
+	unwait(q, newer);
+	if(older->watching >= 0) {
+		unwatch(older);
+	}
+	if(newer->watching >= 0) {
+		unwatch(newer);
+	}
+	forget(older);
+	forget(newer);
+	// a gateway has the game played on a backend, if one will take it
+	if(nbackends && place(older, newer)) {
+		older->lastplayed = newer;
+		newer->lastplayed = older;
+		return;
+	}
+
+	// create new game, roll its stats, send start game messages
+	int g = gamenew(&games);
+	unsigned long gseed = (unsigned long)rand_r(&seed) << 32 ^ rand_r(&seed);
+	logmsg(LOG_DEBUG, "game seed %ld", (long)gseed);
+	gamestart(&games, g, gseed);
+	games.players[0][g] = older;
+	games.players[1][g] = newer;
+	older->lastplayed = newer;
+	newer->lastplayed = older;
+	older->curgame = g;
+	newer->curgame = g;
+	setmode(g, 0);
+	m.n = m.nnums = 0;
+	for(i = 0; i < 2; i++) {
+		struct client* p = i ? older : newer;
+		struct client* opp = i ? newer : older;
+		if(p->binary) {
+			queueframe(p, B_ENGAGE, opp->name, opp->namelen);
+		} else {
+			msgadd(&m, &t_engage, opp);
+			msgsend(p, &m);
 		}
-		iteration = iteration->next;
-    }
-	//if no new game made, return old game head pointer
-    return games;
-}
-
-// Handles ALL the games, from top to the end of the linked list
-// modes: 0: display move msgs, 1: attacking, 2: waiting for chat input; 3 for powermove; 4 waiting for attack
-struct game *handle_games(struct game* top)
-{
-	/*iterate through all games*/
-    struct game* cur = top;
-    char msg[256];
-    for(cur = top; cur != NULL; cur = cur->next) {
-		/* Deal damage, send appropriate messages
-		(turn + 1) % 2 is index of non-moving player*/
-		if(cur -> mode == 1) {
-			int i = rand() % 5 + 2;
-			cur -> hp[(cur->turn + 1) % 2] -= i;
-			sprintf(msg, "You hit %s for %d damage!\r\n", cur -> players[(cur->turn + 1) % 2]->name, i);
-			if (write(cur->players[cur->turn]->fd, msg, strlen(msg)) == -1){
-				perror("write");
-				exit(1);
+	}
+	COUNT(self->m.gamesstarted, 1);
+}
+
+/* how far from p's rating an opponent may be, p having waited since it joined the queue */
+static long reach(struct client* p)
+{
+	return matchwindow + matchwiden * (tickms - p->waitsince) / 1000;
+}
+
+/* pairs off everyone it can in the waiting queue, never with the player who last
+ played them. the work is linear in the players paired plus the number of buckets,
+ however many are waiting: players left unpaired are not looked at again */
+static void matchmake(struct waitqueue* q)
+{
+	struct client *a, *b, *next, *prev;
+	unsigned long bits;
+	int started = 0;
+
+	q->fresh = 0;
+	// one bucket is well within anyone's window, so each is paired off oldest first.
+	// skipping the one player who just played a rules out a single candidate, so
+	// a bucket is left with at most that pair, or one player
+	for(bits = q->nonempty; bits; bits &= bits - 1) {
+		for(a = q->head[__builtin_ctzl(bits)]; a; a = next) {
+			b = a->waitnext;
+			if(b && b->lastplayed == a) {
+				b = b->waitnext;
 			}
-			sprintf(msg, "You got hit by %s for %d damage!\r\n", cur -> players[cur -> turn] -> name, i);
-			if (write(cur->players[(cur -> turn + 1) % 2] -> fd, msg, strlen(msg)) == -1){
-				perror("write");
-				exit(1);
+			if(!b) {
+				break;
 			}
-			cur -> turn = (cur->turn + 1) % 2;
-			cur -> mode = 0;
-		}
-		/*Powermove. Similar code as above, but hit/miss must also be calculated.*/
-		if(cur -> mode == 3) {
-			/*Missed! Simply print messages and switch turns and mode back to wait messaging.*/
-			if(rand()% 2 == 0){
-				if (write(cur -> players[cur -> turn] -> fd, "\r\nYou missed!\r\n", 15) == -1){
-					perror("write");
-					exit(1);
-				}
-				sprintf(msg, "You evaded %s!", cur -> players[cur -> turn] -> name);
-				if (write(cur -> players[(cur -> turn + 1) % 2] -> fd, msg, strlen(msg)) == -1){
-					perror("write");
-					exit(1);
-				}
-				cur -> powermoves[cur -> turn] --;
-				cur->turn = (cur->turn + 1) % 2;
-				cur -> mode = 0;
+			// resume after this pair, which may mean going back to the skipped player
+			next = a->waitnext;
+			if(next == b) {
+				next = b->waitnext;
 			}
-			/* Hit! Same as above, except calculating and subtracting damage too. */
-			else{
-				int i = rand() % 5 + 2;
-				cur->hp[(cur->turn + 1) % 2] -= i * 3;
-				sprintf(msg, "You hit %s for %d damage!\r\n", cur->players[(cur->turn + 1) % 2]->name, i * 3);
-				if (write(cur->players[cur->turn]->fd, msg, strlen(msg)) == -1){
-					perror("write");
-					exit(1);
+			pairup(q, a, b);
+			started++;
+		}
+	}
+	// the few left over are walked in rating order, each offered to the nearest
+	// below it: they are paired if the gap is within the reach of whichever of the
+	// two has waited longer, which grows the longer they wait
+	prev = NULL;
+	for(bits = q->nonempty; bits; bits &= bits - 1) {
+		for(a = q->head[__builtin_ctzl(bits)]; a; a = next) {
+			next = a->waitnext;
+			if(prev && prev->lastplayed != a && a->lastplayed != prev) {
+				struct client* older = prev->waitsince <= a->waitsince ? prev : a;
+				if(abs(a->rating - prev->rating) <= reach(older)) {
+					pairup(q, older, older == a ? prev : a);
+					started++;
+					prev = NULL;
+					continue;
 				}
-				cur -> powermoves[cur -> turn] --;
-				cur->turn = (cur->turn + 1) % 2;
-				cur->mode = 0;
 			}
+			prev = a;
 		}
-		/* Wait messages */
-		if(cur->mode == 0) {
-			/* If someone died (hp < 0), send appropriate messages, deallocate game memory,
+	}
+	if(started) {
+		logmsg(LOG_INFO, "matchmake: %d games started, %d players waiting, waited %ld ms (longest %ld ms)",
+			started, q->count, q->lastwait, q->longestwait);
+	}
+}
+
+/* resolves every game on the ready queue with one battlepass(), then tells the
+ * players how it went: each player's output for a turn is queued in one go */
+void handle_games(void)
+{
+    struct gametab* t = &games;
+    struct msg out[2], sv;
+    int i, x, n, *ids;
+
+    out[0].n = out[0].nnums = out[1].n = out[1].nnums = 0;
+    sv.n = sv.nnums = 0;
+    /* telling players about a turn never readies a game, so this runs once a tick */
+    while(t->nready) {
+		long start = now_ns();
+		// the ready queue becomes the batch, and the old batch the new, empty, queue
+		ids = t->ready;
+		t->ready = t->batch;
+		t->batch = ids;
+		n = t->nready;
+		t->nready = 0;
+		for(i = 0; i < n; i++) {
+			t->readyat[ids[i]] = -1;
+			t->kind[i] = t->mode[ids[i]];
+		}
+		battlepass(t, ids, n, t->dealt);
+		for(i = 0; i < n; i++) {
+			int g = ids[i];
+			int d = t->dealt[i];
+			/* a move hands the turn over, so the player who made it is the one not on turn now */
+			int a = t->kind[i] == 0 ? t->turn[g] : !t->turn[g];
+			struct client* players[2] = { t->players[0][g], t->players[1][g] };
+			/* spectators get one copy of the turn, rendered for none of them in particular */
+			int watched = t->watchers[g] != NULL;
+			COUNT(players[a]->stats->damage, d);
+			if(t->kind[i] == 1) {
+				msgadd(&out[a], &t_hit, players[!a], d);
+				msgadd(&out[!a], &t_gothit, players[a], d);
+			} else if(t->kind[i] == 3 && !d) {
+				msglit(&out[a], "\r\nYou missed!\r\n", 15);
+				msgadd(&out[!a], &t_evaded, players[a]);
+			} else if(t->kind[i] == 3) {
+				msgadd(&out[a], &t_hit, players[!a], d);
+			}
+			if(watched && t->kind[i] != 0) {
+				if(d) {
+					msgadd(&sv, &t_shit, players[a], players[!a], d);
+				} else {
+					msgadd(&sv, &t_smiss, players[a], players[!a]);
+				}
+			}
+			/* If someone died (hp < 0), send appropriate messages, free the game,
 			indicate that both players are no longer in a game */
-			if(cur -> hp[0] <= 0 || cur -> hp[1] <= 0){
-				sprintf(msg, "\r\nYou are no match for %s. You got pwnt...\r\nFinding a new opponent...\r\n", cur -> players[(cur -> turn + 1) % 2] -> name);
-				if (write(cur -> players[cur -> turn] -> fd, msg, strlen(msg)) == -1){
-					perror("write");
-					exit(1);
+			int turn = t->turn[g];
+			int over = t->hp[0][g] <= 0 || t->hp[1][g] <= 0;
+			/* binary players get the same turn as frames; their text is never sent */
+			for(x = 0; x < 2; x++) {
+				if(players[x]->binary) {
+					turnframes(players[x], g, x, a, t->kind[i], d, over);
 				}
-				sprintf(msg, "\r\n%s has surrendered. You win!\r\nFinding a new opponent...\r\n", cur -> players[cur -> turn] -> name);
-				if (write(cur -> players[(cur -> turn + 1) % 2] -> fd, msg, strlen(msg)) == -1){
-					perror("write");
-					exit(1);
+			}
+			if(over) {
+				COUNT(players[!turn]->stats->wins, 1);
+				COUNT(players[turn]->stats->losses, 1);
+				rate(players[!turn], players[turn]);
+				msgadd(&out[turn], &t_lost, players[!turn]);
+				msgadd(&out[!turn], &t_won, players[turn]);
+				if(watched) {
+					msgadd(&sv, &t_sko, players[!turn], players[turn]);
+					watchpost(g, &sv);
 				}
-				cur -> players[0] -> curgame = NULL;
-				cur -> players[1] -> curgame = NULL;
-				top = removegame(top, cur);
+				players[0]->curgame = -1;
+				players[1]->curgame = -1;
+				requeue(players[0]);
+				requeue(players[1]);
+				removegame(g);
 			}
 			/* Write and send player info (hp, powermoves left, etc) to client players*/
-			else{
-				sprintf(msg,
-					"Your hitpoints: %d\r\nYour powermoves: %d \r\n\r\n%s's hitpoints: %d \r\n",
-					cur->hp[cur->turn],
-					cur->powermoves[cur->turn],
-					cur->players[(cur->turn + 1) % 2]->name,
-					cur->hp[(cur->turn + 1) % 2]);
-				if (write(cur->players[cur->turn]->fd, msg, strlen(msg)) == -1){
-					perror("write");
-					exit(1);
+			else {
+				msgadd(&out[turn], &t_status, t->hp[turn][g], t->pm[turn][g], players[!turn], t->hp[!turn][g]);
+				msgadd(&out[!turn], &t_status, t->hp[!turn][g], t->pm[!turn][g], players[turn], t->hp[turn][g]);
+				if(t->pm[turn][g]) {
+					msglit(&out[turn], "\r\n(a)ttack\r\n(p)owermove \r\n(s)peak something \r\n", 47);
+				} else {
+					msglit(&out[turn], "\r\n(a)ttack\r\n(s)peak something \r\n", 33);
 				}
-				sprintf(msg,
-						"Your hitpoints: %d\r\nYour powermoves: %d \r\n\r\n%s's hitpoints: %d \r\n",
-						cur->hp[(cur->turn + 1) % 2],
-						cur->powermoves[(cur->turn + 1) % 2],
-						cur->players[cur->turn]->name,
-						cur->hp[cur->turn]);
-				if (write(cur->players[(cur->turn + 1) % 2]->fd, msg, strlen(msg)) == -1){
-					perror("write");
-					exit(1);
+				msgadd(&out[!turn], &t_waiting, players[turn]);
+				if(watched) {
+					msgadd(&sv, &t_sstatus, players[0], t->hp[0][g], players[1], t->hp[1][g]);
+					watchpost(g, &sv);
 				}
-				if(cur->powermoves[cur->turn]) {
-					if (write(cur->players[cur->turn]->fd, "\r\n(a)ttack\r\n(p)owermove \r\n(s)peak something \r\n", 47) == -1){
-						perror("write");
-						exit(-1);
-					}
+				/* waiting for command mode */
+				t->mode[g] = 4;
+				timerarm(players[turn], TIMER_TURN, turntimeout);
+			}
+			for(x = 0; x < 2; x++) {
+				if(players[x]->binary) {
+					out[x].n = out[x].nnums = 0;
 				} else {
-					if (write(cur->players[cur->turn]->fd, "\r\n(a)ttack\r\n(s)peak something \r\n", 33) == -1){
-						perror("write");
-						exit(-1);
-					}
-				}
-				sprintf(msg, "Waiting for %s to strike...\r\n", cur->players[(cur->turn) % 2]->name);
-				if (write(cur->players[(cur->turn + 1) % 2]->fd, msg, strlen(msg)) == -1){
-					perror("write");
-					exit(1);
+					msgsend(players[x], &out[x]);
 				}
 			}
-			cur->mode = 4;
-			/* waiting for command mode */
 		}
+		// turns are resolved together, so each is charged its share of the batch
+		long each = (now_ns() - start) / n;
+		for(i = 0; i < n; i++) {
+			hrecord(&self->m.turntime, each);
+		}
+	}
+}
+
+/* tells binary player p, player x of game g, how a turn went: the move player a made
+ * (kind 1 or 3, for d damage) unless kind is 0, then whether the game is over, or else
+ * where it stands. it all goes out as one write */
+static void turnframes(struct client* p, int g, int x, int a, int kind, int d, int over)
+{
+	unsigned char f[16];
+	int n = 0;
+
+	if(kind) {
+		f[n++] = 4;
+		f[n++] = B_MOVE;
+		f[n++] = a == x;
+		f[n++] = kind == 3;
+		f[n++] = d;
+	}
+	if(over) {
+		f[n++] = 2;
+		f[n++] = B_OVER;
+		f[n++] = games.turn[g] != x;
+	} else {
+		f[n++] = 8;
+		f[n++] = B_STATUS;
+		f[n++] = games.hp[x][g] >> 8;
+		f[n++] = games.hp[x][g];
+		f[n++] = games.pm[x][g];
+		f[n++] = games.hp[!x][g] >> 8;
+		f[n++] = games.hp[!x][g];
+		f[n++] = games.pm[!x][g];
+		f[n++] = games.turn[g] == x;
+	}
+	queueout(p, (char*)f, n);
+}
+
+/* frees game g, taking it off the ready queue if it is waiting there */
+void removegame(int g){
+	if (games.readyat[g] >= 0){
+		unready(g);
+	}
+	// its spectators have been told it is over, and go back to waiting for a game
+	while (games.watchers[g]){
+		struct client *p = games.watchers[g];
+		unwatch(p);
+		if (!p->dead){
+			pushtoback(&waiting, p);
+		}
+	}
+	games.mode[g] = 5;
+	games.players[0][g] = games.players[1][g] = NULL;
+	games.freeids[games.nfree++] = g;
+	COUNT(self->m.gamesfinished, 1);
+	logmsg(LOG_DEBUG, "game removed");
+}
+
+/* a player with no game typed c: w watches the next battle on this shard after
+ * the one it is watching, if any, and q stops watching. a spectator is out of
+ * the waiting queue, so that any number can watch a game, and goes back into
+ * it when it stops watching or the game ends */
+static void takewatch(struct client* p, char c)
+{
+	int i, g, from = p->watching;
+	struct msg m;
+
+	COUNT(self->m.commands[CMD_WATCH], 1);
+	if(from >= 0) {
+		unwatch(p);
+	}
+	for(i = 1; c == 'w' && i <= games.count; i++) {
+		g = (from + i) % games.count;
+		if(games.mode[g] != 5) {
+			if(p->waiting) {
+				unwait(&waiting, p);
+			}
+			watch(p, g);
+			m.n = m.nnums = 0;
+			msgadd(&m, &t_watch, games.players[0][g], games.players[1][g]);
+			msgadd(&m, &t_sstatus, games.players[0][g], games.hp[0][g], games.players[1][g], games.hp[1][g]);
+			msgsend(p, &m);
+			return;
+		}
+	}
+	if(c == 'w') {
+		queueout(p, "\r\nNo battles to watch right now.\r\n", sizeof("\r\nNo battles to watch right now.\r\n") - 1);
+	}
+	if(!p->waiting) {
+		queueout(p, "\r\nAwaiting opponent...\r\n", sizeof("\r\nAwaiting opponent...\r\n") - 1);
+		pushtoback(&waiting, p);
+	}
+}
+
+/* adds p to game g's spectators */
+static void watch(struct client* p, int g)
+{
+	p->watching = g;
+	p->watchprev = NULL;
+	p->watchnext = games.watchers[g];
+	if(p->watchnext) {
+		p->watchnext->watchprev = p;
+	}
+	games.watchers[g] = p;
+	games.nwatching++;
+}
+
+/* takes p off the spectators of the game it is watching */
+static void unwatch(struct client* p)
+{
+	if(p->watchprev) {
+		p->watchprev->watchnext = p->watchnext;
+	} else {
+		games.watchers[p->watching] = p->watchnext;
+	}
+	if(p->watchnext) {
+		p->watchnext->watchprev = p->watchprev;
+	}
+	p->watchprev = p->watchnext = NULL;
+	p->watching = -1;
+	games.nwatching--;
+}
+
+/* renders m once, into a buffer every spectator of game g then points at, and
+ * empties m. a spectator too far behind misses the event rather than growing its
+ * output without bound; nothing here waits on a spectator, so the players never do */
+static void watchpost(int g, struct msg* m)
+{
+	struct shared* b;
+	struct client* p;
+	int i, len = 0, sent = 0, skipped = 0;
+
+	for(i = 0; i < m->n; i++) {
+		len += m->iov[i].iov_len;
+	}
+	// the poster's reference, let go once every spectator has its own
+	if(!(b = malloc(sizeof(struct shared) + len))) {
+		perror("malloc");
+		exit(1);
+	}
+	atomic_init(&b->refs, 1);
+	b->len = 0;
+	for(i = 0; i < m->n; i++) {
+		memcpy(b->data + b->len, m->iov[i].iov_base, m->iov[i].iov_len);
+		b->len += m->iov[i].iov_len;
+	}
+	m->n = m->nnums = 0;
+	for(p = games.watchers[g]; p; p = p->watchnext) {
+		if(p->outbytes + b->len > WATCHLAG) {
+			skipped++;
+		} else {
+			queueref(p, b, 0, b->len);
+			sent++;
+		}
+	}
+	COUNT(self->m.watchevents, 1);
+	COUNT(self->m.watchsends, sent);
+	COUNT(self->m.watchskips, skipped);
+	sharedput(b);
+}
+
+/* sets g's mode, putting g on the ready queue if handle_games has work to do in that mode */
+void setmode(int g, char mode){
+	games.mode[g] = mode;
+	if ((mode == 0 || mode == 1 || mode == 3) && games.readyat[g] < 0){
+		games.readyat[g] = games.nready;
+		games.ready[games.nready++] = g;
+	}
+}
+
+/* takes g out of the ready queue, moving the last game there into its place */
+static void unready(int g){
+	int last = games.ready[--games.nready];
+	games.ready[games.readyat[g]] = last;
+	games.readyat[last] = games.readyat[g];
+	games.readyat[g] = -1;
+}
+
+ /*pushes *topush to the back of its rating's bucket in waiting queue *q and starts its wait clock */
+void pushtoback(struct waitqueue *q, struct client *topush){
+	int b = topush->rating / RATINGSTEP;
+	b = b < 0 ? 0 : b < RATINGBUCKETS ? b : RATINGBUCKETS - 1;
+	topush->waitbucket = b;
+	topush->waitnext = NULL;
+	topush->waitprev = q->tail[b];
+	if (q->tail[b]){
+		q->tail[b]->waitnext = topush;
+	}
+	else{
+		q->head[b] = topush;
+		q->nonempty |= 1UL << b;
+	}
+	q->tail[b] = topush;
+	topush->waiting = 1;
+	topush->unpaired = 0;
+	topush->waitsince = tickms;
+	q->count++;
+	q->fresh = 1;
+}
+
+/* takes p out of waiting queue *q wherever it is */
+static void unwait(struct waitqueue *q, struct client *p){
+	int b = p->waitbucket;
+	if (p->waitprev){
+		p->waitprev->waitnext = p->waitnext;
+	}
+	else{
+		q->head[b] = p->waitnext;
+	}
+	if (p->waitnext){
+		p->waitnext->waitprev = p->waitprev;
+	}
+	else{
+		q->tail[b] = p->waitprev;
+	}
+	if (!q->head[b]){
+		q->nonempty &= ~(1UL << b);
+	}
+	p->waitprev = p->waitnext = NULL;
+	p->waiting = 0;
+	q->count--;
+}
+
+/* moves winner's and loser's ratings by how unexpected the result was (Elo):
+ * beating an equal gains RATINGK / 2, beating a far better player nearly RATINGK */
+static void rate(struct client* winner, struct client* loser){
+	double expected = 1.0 / (1.0 + pow(10.0, (loser->rating - winner->rating) / 400.0));
+	int delta = (int)lround(RATINGK * (1.0 - expected));
+	winner->rating += delta;
+	loser->rating -= delta;
+}
+
+/* milliseconds on the monotonic clock */
+long now_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* nanoseconds on the monotonic clock */
+long now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* appends size bytes of s to p's output chain; nothing is sent until the end of the tick */
+void queueout(struct client *p, const char *s, int size){
+	struct iovec iov = { (void *)s, size };
+	queueoutv(p, &iov, 1);
+}
+
+/* whether size more bytes fit in p's output; a client that stops reading is
+ * disconnected rather than buffered without bound */
+static int outroom(struct client *p, int size){
+	if (p->dead){
+		return 0;
 	}
-    return top;
+	if (p->outbytes + size > (p->ls ? LINKLIMIT : OUTLIMIT)){
+		logmsg(LOG_WARN, "%d bytes of output pending for fd %d, disconnecting", p->outbytes, p->fd);
+		COUNT(self->m.writefailures, 1);
+		dropclient(p);
+		return 0;
+	}
+	return 1;
 }
 
-/* remove game *rem from linked list of struct games if *rem is in linked list with head top
-   return new head of list*/
-struct game * removegame(struct game *top, struct game *rem){
-	struct game *cur = top;
-	/* if we want to remove head, set head to head.next, free head, return pointer to head.next */
-	if (top == rem) {
-		cur = top -> next;
-		free(top);
-		printf("game removed\n");
-		return cur;
+/* links a fresh, empty chunk onto the end of p's output chain */
+static struct outchunk *newchunk(struct client *p){
+	struct outchunk *c = poolget(&self->chunkpool);
+	c->next = NULL;
+	c->ref = NULL;
+	c->off = c->len = 0;
+	if (p->outtail){
+		p->outtail->next = c;
 	}
-	/* don't want to remove head */
 	else{
-		/* iterate through all games, remove rem by linking node before rem to node after rem and freeing rem*/
-		struct game *prev = NULL;
-		for(cur = top; cur; cur = cur -> next){
-			if(cur == rem){ 
-				prev -> next = cur -> next;
-				free(cur);
-				printf("game removed\n");
-				return top;
+		p->outhead = c;
+	}
+	p->outtail = c;
+	return c;
+}
+
+/* puts p on the flush list for the end of the tick */
+static void wantflush(struct client *p){
+	if (!p->flushing){
+		p->flushnext = flushlist;
+		flushlist = p;
+		p->flushing = 1;
+	}
+}
+
+/* appends the n pieces of iov to p's output chain, copying each straight into the chain */
+void queueoutv(struct client *p, const struct iovec *iov, int n){
+	int i, size = 0;
+	for (i = 0; i < n; i++){
+		size += iov[i].iov_len;
+	}
+	if (!outroom(p, size)){
+		return;
+	}
+	for (i = 0; i < n; i++){
+		const char *s = iov[i].iov_base;
+		size = iov[i].iov_len;
+		while (size > 0){
+			struct outchunk *c = p->outtail;
+			if (!c || c->ref || c->len == OUTCHUNK){
+				c = newchunk(p);
+			}
+			int len = OUTCHUNK - c->len < size ? OUTCHUNK - c->len : size;
+			memcpy(c->data + c->len, s, len);
+			c->len += len;
+			p->outbytes += len;
+			s += len;
+			size -= len;
+		}
+	}
+	wantflush(p);
+}
+
+/* appends b->data[off] .. b->data[len - 1] to p's output chain without copying it */
+void queueref(struct client *p, struct shared *b, int off, int len){
+	struct outchunk *c;
+	if (off >= len || !outroom(p, len - off)){
+		return;
+	}
+	c = newchunk(p);
+	c->ref = b;
+	atomic_fetch_add(&b->refs, 1);
+	c->off = off;
+	c->len = len;
+	p->outbytes += len - off;
+	wantflush(p);
+}
+
+/* drops a reference to b, freeing it with the last one */
+void sharedput(struct shared *b){
+	if (atomic_fetch_sub(&b->refs, 1) == 1){
+		free(b);
+	}
+}
+
+/* frees c, and its reference to shared bytes if it has one */
+static void chunkput(struct outchunk *c){
+	if (c->ref){
+		sharedput(c->ref);
+	}
+	poolput(c);
+}
+
+/* p's input buffer, borrowed from the shard's pool if p has none */
+static char *inbuf(struct client *p){
+	if (!p->curmessage){
+		p->curmessage = poolget(&self->inpool);
+	}
+	return p->curmessage;
+}
+
+/* gives p's input buffer back once no line or frame is part way in, so an
+ * idle connection holds none */
+static void inbufdone(struct client *p){
+	if (p->curmessage && !p->curlen){
+		poolput(p->curmessage);
+		p->curmessage = NULL;
+	}
+}
+
+/* sends as much of p's output chain as the socket takes, one writev per MAXIOV chunks;
+ * whatever is left waits for EPOLLOUT. a client being dropped still gets one try,
+ * so a parting message can go out before the socket is closed */
+void flushclient(struct client *p){
+	struct iovec iov[MAXIOV];
+	struct outchunk *c;
+	int n;
+
+	if (p->fd < 0){
+		// a gateway's player: its output goes back over the link, and once a
+		// game is over, so does the player
+		while ((c = p->outhead) != NULL){
+			if (p->link){
+				linkdata(p->link, p->stream, (c->ref ? c->ref->data : c->data) + c->off, c->len - c->off);
+			}
+			p->outhead = c->next;
+			chunkput(c);
+		}
+		p->outtail = NULL;
+		p->outbytes = 0;
+		if (p->release){
+			killclient(p);
+		}
+		return;
+	}
+	if (replaying){
+		// nobody to send to: fold the output, and who it was for, into the digest
+		replaydigest = fnv(replaydigest, &p->fd, sizeof(p->fd));
+		while ((c = p->outhead) != NULL){
+			replaydigest = fnv(replaydigest, (c->ref ? c->ref->data : c->data) + c->off, c->len - c->off);
+			COUNT(self->m.bytesout, c->len - c->off);
+			p->outhead = c->next;
+			chunkput(c);
+		}
+		p->outtail = NULL;
+		p->outbytes = 0;
+		return;
+	}
+	while (p->outhead){
+		for (n = 0, c = p->outhead; c && n < MAXIOV; c = c->next, n++){
+			iov[n].iov_base = (c->ref ? c->ref->data : c->data) + c->off;
+			iov[n].iov_len = c->len - c->off;
+		}
+		ssize_t sent = writev(p->fd, iov, n);
+		if (sent == -1){
+			if (errno == EINTR){
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK && !p->dead){
+				logmsg(LOG_WARN, "writev to %a: %e", p->ipaddr, errno);
+				COUNT(self->m.writefailures, 1);
+				dropclient(p);
+			}
+			return;
+		}
+		p->outbytes -= sent;
+		COUNT(self->m.bytesout, sent);
+		while (sent > 0){
+			c = p->outhead;
+			if (sent < c->len - c->off){
+				c->off += sent;
+				break;
 			}
-			prev=cur;
-		}
-	}
-	return top;
-}
- 
- /*pushes *topush to back of linked list with head *top ; return new head */
-struct client *pushtoback(struct client *top, struct client *topush){
-	struct client *curr;
-	/* return null head if head is null */
-	if (!top){
-		return top;
-	}
-	/* if head pushed back, head.next is new head */
-	if(topush == top){
-		top = top -> next;
-	}
-	/* unless the head has no next */
-	if (!top){
-		return topush;
-	}
-	for(curr = top; curr && curr -> next; curr = curr -> next){} 
-	//make curr point to last element in list
-	curr -> next = topush;
-	topush -> next = NULL;
-	/* set topush as old last link's next, set last link to null 
-	 * covers case where topush is last element in list */
-	return top;
-}
\ No newline at end of file
+			sent -= c->len - c->off;
+			p->outhead = c->next;
+			chunkput(c);
+		}
+		if (!p->outhead){
+			p->outtail = NULL;
+		}
+	}
+}
+
+/* flushes every client that had output queued this tick */
+void flushall(void){
+	struct client *p;
+	while ((p = flushlist) != NULL){
+		flushlist = p->flushnext;
+		p->flushing = 0;
+		flushclient(p);
+	}
+}
+
+/* marks p for disconnection at the end of the tick; p stays allocated until then
+ * so pointers held elsewhere this tick remain valid */
+void killclient(struct client *p){
+	if (p->dead){
+		return;
+	}
+	p->dead = 1;
+	if (p->waiting){
+		unwait(&waiting, p);
+	}
+	p->deadnext = deadlist;
+	deadlist = p;
+}
+
+/* marks p for disconnection because its connection failed, and journals that;
+ * during a tick's events it is a hangup, replayed in order, and after them a drop,
+ * replayed once the tick's games are done */
+static void dropclient(struct client *p){
+	if (!p->dead){
+		journalput(inevents ? J_CLOSE : J_DROP, p->fd, NULL, 0);
+	}
+	killclient(p);
+}
+
+/* removes and closes every dead client; returns how many were reaped.
+ * runs after flushall, and queueout ignores dead clients, so none is on flushlist */
+int reapdead(struct clienttab *tab, int epfd){
+	struct client *p;
+	int n = 0;
+	while ((p = deadlist) != NULL){
+		int fd = p->fd;
+		deadlist = p->deadnext;
+		removeclient(tab, p);
+		COUNT(self->m.disconnects, 1);
+		// a replayed client's fd is only a name, and a gateway's player has none
+		if (!replaying && fd >= 0){
+			epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+			close(fd);
+		}
+		n++;
+	}
+	return n;
+}
+
+/* moves waiting player p from this shard to shard to. p leaves our epoll set,
+ * table and waiting queue here and joins to's when to drains its inbox.
+ * must not be called while p is on flushlist or deadlist */
+static void handoff(struct clienttab* tab, struct client* p, struct shard* to)
+{
+    unwait(&waiting, p);
+    // games are per shard, so there is nothing to watch from here on to
+    if(p->watching >= 0) {
+	unwatch(p);
+    }
+    // p's last opponent stays here
+    forget(p);
+    timercancel(p);
+    epoll_ctl(self->epfd, EPOLL_CTL_DEL, p->fd, NULL);
+    tab->byfd[p->fd] = NULL;
+    dropslot(tab, p);
+    p->handoffnext = atomic_load(&to->inbox);
+    while(!atomic_compare_exchange_weak(&to->inbox, &p->handoffnext, p))
+	;
+    eventfd_write(to->wakefd, 1);
+}
+
+/* hands every player that has waited a whole handoff pass here without a partner to the
+ * shard with the fewest games in progress (the lowest numbered, on a tie), so the unpaired
+ * from every shard meet there and their games start there. the rest are marked, to go at
+ * the next pass if they are still waiting then */
+static void handunpaired(struct clienttab* tab)
+{
+    struct client *p, *next;
+    unsigned long bits;
+    long n, fewest = 0;
+    int i, to = -1;
+
+    for(i = 0; i < nshards; i++) {
+	n = READ(shards[i].m.gamesstarted) - READ(shards[i].m.gamesfinished);
+	if(to < 0 || n < fewest) {
+	    fewest = n;
+	    to = i;
+	}
+    }
+    for(bits = waiting.nonempty; bits; bits &= bits - 1) {
+	for(p = waiting.head[__builtin_ctzl(bits)]; p; p = next) {
+	    next = p->waitnext;
+	    if(p->unpaired && to != self->id) {
+		handoff(tab, p, &shards[to]);
+	    } else {
+		p->unpaired = 1;
+	    }
+	}
+    }
+}
+
+/* adopts every player other shards have handed over since the last call.
+ * the eventfd is reset before the inbox is emptied, so a push that races
+ * with us always leaves a wakeup behind */
+static void takehandoffs(struct clienttab* tab)
+{
+    eventfd_t n;
+    struct client *p, *next, *rev = NULL;
+
+    eventfd_read(self->wakefd, &n);
+    p = atomic_exchange(&self->inbox, NULL);
+    // the inbox is a stack; reverse it so players queue up in the order they were sent
+    for(; p; p = next) {
+	next = p->handoffnext;
+	p->handoffnext = rev;
+	rev = p;
+    }
+    for(p = rev; p; p = next) {
+	long since = p->waitsince;
+	next = p->handoffnext;
+	tabinsert(tab, p);
+	// registering reports any input or buffer space that turned up in transit
+	watchfd(self->epfd, p->fd, p, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+	pushtoback(&waiting, p);
+	p->waitsince = since;
+	// batch numbers are per shard
+	p->lobbybatch = 0;
+	timerarm(p, TIMER_IDLE, idletimeout - (tickms - p->lastinput));
+    }
+}
+
+/* sets up an empty pool of objects of size bytes, owned by shard */
+void poolinit(struct pool* pl, int shard, const char* what, size_t size)
+{
+    pl->what = what;
+    pl->shard = shard;
+    // room for the header that remembers which pool an object belongs to
+    pl->size = sizeof(struct pool*) + (size + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+    pl->free = NULL;
+    atomic_init(&pl->remote, NULL);
+    pl->inuse = pl->highwater = pl->slabs = 0;
+}
+
+/* takes an object from pl, which must belong to this shard. objects other
+ * shards have freed are reclaimed first; a new slab is carved only when
+ * there are none, and each new slab is reported with the pool's stats */
+void* poolget(struct pool* pl)
+{
+    void** obj;
+
+    if(!pl->free && (pl->free = atomic_exchange(&pl->remote, NULL)) != NULL) {
+	for(obj = pl->free; obj; obj = obj[1]) {
+	    pl->inuse--;
+	}
+    }
+    if(!pl->free) {
+	char* slab = malloc(pl->size * POOLSLAB);
+	int i;
+	if(!slab) {
+	    perror("malloc");
+	    exit(1);
+	}
+	for(i = POOLSLAB - 1; i >= 0; i--) {
+	    obj = (void**)(slab + i * pl->size);
+	    obj[0] = pl;
+	    obj[1] = pl->free;
+	    pl->free = obj;
+	}
+	pl->slabs++;
+	logmsg(LOG_INFO, "%s pool grew to %d slabs (%d in use, high water %d)",
+	    pl->what, pl->slabs, pl->inuse, pl->highwater);
+    }
+    obj = pl->free;
+    pl->free = obj[1];
+    if(++pl->inuse > pl->highwater) {
+	pl->highwater = pl->inuse;
+    }
+    return obj + 1;
+}
+
+/* bytes of memory pl has carved, in use or not */
+static long poolbytes(struct pool* pl)
+{
+    return (long)pl->slabs * POOLSLAB * pl->size;
+}
+
+/* gives obj back to the pool it came from, whichever shard that is */
+void poolput(void* obj)
+{
+    void** hdr = (void**)obj - 1;
+    struct pool* pl = hdr[0];
+
+    if(pl->shard == self->id) {
+	hdr[1] = pl->free;
+	pl->free = hdr;
+	pl->inuse--;
+	return;
+    }
+    // another shard's object: push it on that pool's remote stack for its owner to reclaim
+    hdr[1] = atomic_load(&pl->remote);
+    while(!atomic_compare_exchange_weak(&pl->remote, &hdr[1], hdr))
+	;
+}
+
+/* bucket of value v: exact below 2^HSUBBITS, then 2^HSUBBITS buckets per power of two */
+static int hbucket(long v)
+{
+    if(v < (1 << HSUBBITS)) {
+	return v < 0 ? 0 : v;
+    }
+    int msb = 63 - __builtin_clzl(v);
+    return ((msb - HSUBBITS + 1) << HSUBBITS) + ((v >> (msb - HSUBBITS)) & ((1 << HSUBBITS) - 1));
+}
+
+/* smallest value that falls in bucket i */
+static long hfloor(int i)
+{
+    if(i < (1 << HSUBBITS)) {
+	return i;
+    }
+    int msb = (i >> HSUBBITS) + HSUBBITS - 1;
+    return (1L << msb) + ((long)(i & ((1 << HSUBBITS) - 1)) << (msb - HSUBBITS));
+}
+
+/* adds v to this shard's histogram h */
+void hrecord(struct histogram* h, long v)
+{
+    COUNT(h->counts[hbucket(v)], 1);
+    COUNT(h->sum, v);
+}
+
+/* writes histogram name, merged over every shard, as a summary with quantiles */
+static void writesummary(FILE* out, const char* name, const char* help, size_t offset)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    long counts[HBUCKETS];
+    long total = 0, sum = 0, seen;
+    int i, j, q, top = 0;
+
+    memset(counts, 0, sizeof(counts));
+    for(j = 0; j < nshards; j++) {
+	struct histogram* h = (struct histogram*)((char*)&shards[j].m + offset);
+	for(i = 0; i < HBUCKETS; i++) {
+	    counts[i] += READ(h->counts[i]);
+	}
+	sum += READ(h->sum);
+    }
+    for(i = 0; i < HBUCKETS; i++) {
+	total += counts[i];
+	if(counts[i]) {
+	    top = i;
+	}
+    }
+    fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+    for(q = 0, i = 0, seen = 0; q < 4; q++) {
+	while(i < HBUCKETS && (seen + counts[i] < quantiles[q] * total || !counts[i])) {
+	    seen += counts[i++];
+	}
+	fprintf(out, "%s{quantile=\"%g\"} %ld\n", name, quantiles[q], total ? hfloor(i) : 0);
+    }
+    fprintf(out, "%s{quantile=\"1\"} %ld\n%s_sum %ld\n%s_count %ld\n", name, hfloor(top), name, sum, name, total);
+}
+
+/* writes counter or gauge name, summed over every shard */
+static void writesum(FILE* out, const char* name, const char* type, const char* help, size_t offset)
+{
+    long total = 0;
+    int j;
+
+    for(j = 0; j < nshards; j++) {
+	total += READ(*(_Atomic long*)((char*)&shards[j].m + offset));
+    }
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %ld\n", name, help, name, type, name, total);
+}
+
+/* renders every metric in the Prometheus text format into a malloc'd string */
+static char* rendermetrics(size_t* len)
+{
+    static const char* cmdnames[NCMDS] = { "name", "attack", "powermove", "speak", "chat", "watch", "rejected" };
+    long started = 0, finished = 0, cmds[NCMDS];
+    char* text;
+    FILE* out = open_memstream(&text, len);
+    int i, j;
+
+    if(!out) {
+	return NULL;
+    }
+#define SUM(name, field, type, help) writesum(out, name, type, help, offsetof(struct metrics, field))
+    SUM("battle_accepts_total", accepts, "counter", "Connections accepted.");
+    SUM("battle_disconnects_total", disconnects, "counter", "Clients disconnected, for any reason.");
+    SUM("battle_games_started_total", gamesstarted, "counter", "Games started by matchmake.");
+    SUM("battle_games_finished_total", gamesfinished, "counter", "Games over, by knockout or by a player leaving.");
+    SUM("battle_bytes_in_total", bytesin, "counter", "Bytes read from clients.");
+    SUM("battle_bytes_out_total", bytesout, "counter", "Bytes written to clients.");
+    SUM("battle_write_failures_total", writefailures, "counter", "Clients dropped because a write failed or their output backed up.");
+    SUM("battle_log_dropped_total", logdropped, "counter", "Log records dropped because their shard's ring was full.");
+    SUM("battle_clients", clients, "gauge", "Connected clients.");
+    SUM("battle_waiting", waiting, "gauge", "Named players waiting for an opponent.");
+    SUM("battle_timers", timers, "gauge", "Deadlines armed in the timer wheels.");
+    SUM("battle_name_timeouts_total", timeouts[TIMER_NAME], "counter", "Clients dropped for not giving a name in time.");
+    SUM("battle_turn_timeouts_total", timeouts[TIMER_TURN], "counter", "Turns decided because the player ran out of time.");
+    SUM("battle_idle_kicks_total", timeouts[TIMER_IDLE], "counter", "Clients dropped for saying nothing for too long.");
+    SUM("battle_lobby_batches_total", lobbybatches, "counter", "Batches of lobby announcements sent.");
+    SUM("battle_lobby_sends_total", lobbysends, "counter", "Lobby batches queued to a client, by reference.");
+    SUM("battle_spectators", spectators, "gauge", "Players watching a battle instead of waiting for one.");
+    SUM("battle_spectator_events_total", watchevents, "counter", "Battle events rendered for spectators, once each however many watch.");
+    SUM("battle_spectator_sends_total", watchsends, "counter", "Battle events queued to a spectator, by reference.");
+    SUM("battle_spectator_skips_total", watchskips, "counter", "Battle events a spectator missed for being too far behind.");
+    SUM("battle_binary_clients_total", binaryclients, "counter", "Clients that switched to the binary protocol.");
+    SUM("battle_rejected_full_total", rejected[REJ_FULL], "counter", "Connections turned away because the server was full.");
+    SUM("battle_rejected_per_ip_total", rejected[REJ_PERIP], "counter", "Connections turned away for their address having too many open.");
+    SUM("battle_rejected_rate_total", rejected[REJ_RATE], "counter", "Connections turned away for their address connecting too often.");
+    SUM("battle_shed_total", shed, "counter", "Connections closed unheard because the process was out of fds.");
+    SUM("battle_games_placed_total", gamesplaced, "counter", "Games a gateway placed on a backend.");
+    SUM("battle_links", links, "gauge", "Links between a gateway and its backends.");
+    SUM("battle_pool_bytes", poolbytes, "gauge", "Memory carved for clients and their input and output buffers.");
+#undef SUM
+    memset(cmds, 0, sizeof(cmds));
+    for(j = 0; j < nshards; j++) {
+	started += READ(shards[j].m.gamesstarted);
+	finished += READ(shards[j].m.gamesfinished);
+	for(i = 0; i < NCMDS; i++) {
+	    cmds[i] += READ(shards[j].m.commands[i]);
+	}
+    }
+    fprintf(out, "# HELP battle_games Games in progress.\n# TYPE battle_games gauge\nbattle_games %ld\n", started - finished);
+    fprintf(out, "# HELP battle_commands_total Client input by kind.\n# TYPE battle_commands_total counter\n");
+    for(i = 0; i < NCMDS; i++) {
+	fprintf(out, "battle_commands_total{type=\"%s\"} %ld\n", cmdnames[i], cmds[i]);
+    }
+    if(statsfile) {
+	fprintf(out, "# HELP battle_players Players with a record in the stats file.\n# TYPE battle_players gauge\nbattle_players %u\n",
+	    READ(statsfile->count) < statsfile->cap ? READ(statsfile->count) : statsfile->cap);
+    }
+    writesummary(out, "battle_loop_ns", "Event-loop iteration time, not counting the wait.", offsetof(struct metrics, looptime));
+    writesummary(out, "battle_matchwait_ms", "How long paired players waited for an opponent.", offsetof(struct metrics, matchwait));
+    writesummary(out, "battle_turn_ns", "Time handle_games spent on one game turn.", offsetof(struct metrics, turntime));
+    writesummary(out, "battle_match_gap", "Rating difference between paired players.", offsetof(struct metrics, matchgap));
+    fclose(out);
+    return text;
+}
+
+/* serves the metrics over HTTP on 127.0.0.1:adminport, one blocking request at a time.
+ * it runs on its own thread and only reads the shards' metrics, so scraping never
+ * stalls an event loop */
+void* runadmin(void* arg)
+{
+    struct sockaddr_in r;
+    int listenfd = adminfd, fd, yes = 1;
+
+    // after a hot restart the old server's listener is already bound
+    if(listenfd < 0) {
+	if((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+	    perror("socket");
+	    return NULL;
+	}
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+	memset(&r, '\0', sizeof(r));
+	r.sin_family = AF_INET;
+	r.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	r.sin_port = htons(adminport);
+	if(bind(listenfd, (struct sockaddr*)&r, sizeof r) || listen(listenfd, 16)) {
+	    perror("admin socket");
+	    close(listenfd);
+	    return NULL;
+	}
+	adminfd = listenfd;
+    }
+    logmsg(LOG_INFO, "metrics on 127.0.0.1:%d", adminport);
+    while(1) {
+	char req[1024], head[128];
+	size_t len;
+	char* body;
+
+	if((fd = accept(listenfd, NULL, NULL)) < 0) {
+	    continue;
+	}
+	// whatever was asked for, the answer is the metrics page
+	if(recv(fd, req, sizeof(req), 0) >= 0 && (body = rendermetrics(&len))) {
+	    int n = sprintf(head, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+	    if(send(fd, head, n, MSG_NOSIGNAL) == n) {
+		send(fd, body, len, MSG_NOSIGNAL);
+	    }
+	    free(body);
+	}
+	close(fd);
+    }
+    return NULL;
+}
+
+/* writes log record r as one line: wall-clock time, level, shard, message.
+ * warnings and errors go to stderr, the rest to stdout */
+static void writelog(struct logrec* r)
+{
+    FILE* out = r->level >= LOG_WARN ? stderr : stdout;
+    char addr[INET_ADDRSTRLEN];
+    const char* f;
+    int n = 0;
+
+    flockfile(out);
+    fprintf(out, "%ld.%06ld %s", r->ns / 1000000000, r->ns / 1000 % 1000000, levelnames[r->level]);
+    if(r->shard >= 0) {
+	fprintf(out, " shard %d", r->shard);
+    }
+    fputs(": ", out);
+    for(f = r->fmt; *f; f++) {
+	if(*f != '%') {
+	    putc_unlocked(*f, out);
+	    continue;
+	}
+	if(*++f == 'l') {
+	    f++;
+	}
+	if(*f == '%') {
+	    putc_unlocked('%', out);
+	    continue;
+	}
+	if(n == LOGARGS) {
+	    break;
+	}
+	long a = r->args[n++];
+	if(*f == 'd') {
+	    fprintf(out, "%ld", a);
+	} else if(*f == 's') {
+	    fputs(r->text + a, out);
+	} else if(*f == 'a') {
+	    struct in_addr in = { .s_addr = a };
+	    fputs(inet_ntop(AF_INET, &in, addr, sizeof(addr)), out);
+	} else if(*f == 'e') {
+	    fputs(strerror(a), out);
+	}
+    }
+    putc_unlocked('\n', out);
+    funlockfile(out);
+}
+
+/* logs fmt (see struct logrec) at level. on a shard this only copies the
+ * arguments into the shard's ring, and if the ring is full the record is
+ * dropped and counted rather than waited for; anywhere else it is written at once */
+void logmsg(int level, const char* fmt, ...)
+{
+    struct logrec local, *r = &local;
+    unsigned long head = 0;
+    va_list ap;
+    const char* f;
+    int n = 0, used = 0;
+
+    if(level < loglevel) {
+	return;
+    }
+    if(self) {
+	head = atomic_load_explicit(&self->log.head, memory_order_relaxed);
+	if(head - atomic_load_explicit(&self->log.tail, memory_order_acquire) == LOGRING) {
+	    COUNT(self->m.logdropped, 1);
+	    return;
+	}
+	r = &self->log.recs[head & (LOGRING - 1)];
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    r->ns = ts.tv_sec * 1000000000L + ts.tv_nsec;
+    r->fmt = fmt;
+    r->level = level;
+    r->shard = self ? self->id : -1;
+    r->text[LOGTEXT - 1] = '\0';
+    va_start(ap, fmt);
+    for(f = fmt; *f && n < LOGARGS; f++) {
+	if(*f != '%') {
+	    continue;
+	}
+	int islong = *++f == 'l';
+	if(islong) {
+	    f++;
+	}
+	if(*f == 'd' || *f == 'e') {
+	    r->args[n++] = islong ? va_arg(ap, long) : va_arg(ap, int);
+	} else if(*f == 'a') {
+	    r->args[n++] = va_arg(ap, struct in_addr).s_addr;
+	} else if(*f == 's') {
+	    const char* s = va_arg(ap, const char*);
+	    int room = LOGTEXT - 1 - used;
+	    int len = room > 0 ? strnlen(s, room) : 0;
+	    // a string that doesn't fit is cut short; one with no room at all is empty
+	    r->args[n++] = room > 0 ? used : LOGTEXT - 1;
+	    if(room > 0) {
+		memcpy(r->text + used, s, len);
+		r->text[used + len] = '\0';
+		used += len + 1;
+	    }
+	}
+    }
+    va_end(ap);
+    if(self) {
+	atomic_store_explicit(&self->log.head, head + 1, memory_order_release);
+    } else {
+	writelog(r);
+    }
+}
+
+/* formats and writes every shard's log records, off the event loops.
+ * reports drops as it notices them, and sleeps briefly whenever every ring is empty */
+void* runlogger(void* arg)
+{
+    long* dropped = calloc(nshards, sizeof(long));
+    int i;
+
+    while(1) {
+	int busy = 0;
+	for(i = 0; i < nshards; i++) {
+	    struct logring* ring = &shards[i].log;
+	    unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	    unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	    for(; tail != head; tail++, busy++) {
+		writelog(&ring->recs[tail & (LOGRING - 1)]);
+	    }
+	    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	    long d = READ(shards[i].m.logdropped);
+	    if(dropped && d != dropped[i]) {
+		fprintf(stderr, "shard %d: %ld log records dropped\n", i, d - dropped[i]);
+		dropped[i] = d;
+		busy++;
+	    }
+	}
+	if(busy) {
+	    fflush(stdout);
+	    fflush(stderr);
+	} else {
+	    usleep(LOGIDLE);
+	}
+    }
+    return NULL;
+}
+
+/* waits for the logger to catch up with every shard, so exit() flushes everything logged */
+static void logwait(void)
+{
+    int i;
+
+    for(i = 0; i < nshards; i++) {
+	while(atomic_load(&shards[i].log.tail) != atomic_load(&shards[i].log.head)) {
+	    usleep(LOGIDLE);
+	}
+    }
+}
+
+/* empties the wheel and starts it at tick now */
+void wheelinit(long now)
+{
+    int i, j;
+
+    wheel.now = now;
+    wheel.count = 0;
+    for(i = 0; i < WHEELLEVELS; i++) {
+	for(j = 0; j < WHEELSLOTS; j++) {
+	    wheel.slots[i][j].next = wheel.slots[i][j].prev = &wheel.slots[i][j];
+	}
+    }
+}
+
+/* links t into the slot for its deadline: the lowest level whose span reaches it.
+ * a deadline that is already due goes in the current level-0 slot, which only
+ * happens while wheeladvance is about to fire it */
+static void wheelinsert(struct timer* t)
+{
+    long delta = t->expires - wheel.now;
+    int level = 0;
+    struct timer* head;
+
+    if(delta >= 1L << (WHEELBITS * WHEELLEVELS)) {
+	t->expires = wheel.now + (1L << (WHEELBITS * WHEELLEVELS)) - 1;
+	delta = t->expires - wheel.now;
+    }
+    if(delta <= 0) {
+	head = &wheel.slots[0][wheel.now & (WHEELSLOTS - 1)];
+    } else {
+	while(delta >= 1L << (WHEELBITS * (level + 1))) {
+	    level++;
+	}
+	head = &wheel.slots[level][(t->expires >> (WHEELBITS * level)) & (WHEELSLOTS - 1)];
+    }
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/* unlinks every timer in slot head onto the list headed by list */
+static void wheeltake(struct timer* head, struct timer* list)
+{
+    if(head->next == head) {
+	list->next = list->prev = list;
+	return;
+    }
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    head->next = head->prev = head;
+}
+
+/* what happens when p's deadline passes. a player whose turn it is moves
+ * (or forfeits) unless they have been idle too long; idle clients are kicked,
+ * which for a player in a game hands the win to their opponent */
+static void expire(struct client* p)
+{
+    int g = p->curgame;
+    long idle = tickms - p->lastinput;
+
+    if(p->dead) {
+	return;
+    }
+    if(p->timer.kind == TIMER_NAME) {
+	COUNT(self->m.timeouts[TIMER_NAME], 1);
+	timeoutnote(p, BT_NAME, "\r\nToo slow to give a name. Goodbye!\r\n", 37);
+	killclient(p);
+	return;
+    }
+    if(p->timer.kind == TIMER_TURN && idle < idletimeout &&
+	g >= 0 && mover(g) == p && (games.mode[g] == 4 || games.mode[g] == 2)) {
+	COUNT(self->m.timeouts[TIMER_TURN], 1);
+	timerarm(p, TIMER_IDLE, idletimeout - idle);
+	if(forfeit) {
+	    timeoutnote(p, BT_FORFEIT, "\r\nOut of time! You forfeit.\r\n", 29);
+	    COUNT(p->stats->forfeits, 1);
+	    games.hp[games.turn[g]][g] = 0;
+	    setmode(g, 0);
+	} else {
+	    timeoutnote(p, BT_ATTACK, "\r\nOut of time! You attack.\r\n", 28);
+	    setmode(g, 1);
+	}
+	return;
+    }
+    if(idle >= idletimeout) {
+	COUNT(self->m.timeouts[TIMER_IDLE], 1);
+	timeoutnote(p, BT_IDLE, "\r\nIdle for too long. Goodbye!\r\n", 31);
+	killclient(p);
+	return;
+    }
+    // a turn timer for a turn that is over, or input came in since it was armed
+    timerarm(p, TIMER_IDLE, idletimeout - idle);
+}
+
+/* tells p that one of its deadlines passed: text s, or a frame saying why */
+static void timeoutnote(struct client* p, int why, const char* s, int len)
+{
+    unsigned char b = why;
+
+    if(p->binary) {
+	queueframe(p, B_TIMEOUT, &b, 1);
+    } else {
+	queueout(p, s, len);
+    }
+}
+
+/* moves the wheel on to tick to, firing every timer due on the way */
+void wheeladvance(long to)
+{
+    struct timer list, *t;
+    int level;
+
+    // nothing armed: nothing to cascade or fire on the way
+    if(!wheel.count && wheel.now < to) {
+	wheel.now = to;
+    }
+    while(wheel.now < to) {
+	wheel.now++;
+	// each level that wraps around pulls its next slot down a level
+	for(level = 1; level < WHEELLEVELS; level++) {
+	    if(wheel.now & ((1L << (WHEELBITS * level)) - 1)) {
+		break;
+	    }
+	    wheeltake(&wheel.slots[level][(wheel.now >> (WHEELBITS * level)) & (WHEELSLOTS - 1)], &list);
+	    while((t = list.next) != &list) {
+		list.next = t->next;
+		wheelinsert(t);
+	    }
+	}
+	// detached first, so timers re-armed by expire() land in a fresh list
+	wheeltake(&wheel.slots[0][wheel.now & (WHEELSLOTS - 1)], &list);
+	while((t = list.next) != &list) {
+	    list.next = t->next;
+	    t->next = NULL;
+	    wheel.count--;
+	    expire((struct client*)((char*)t - offsetof(struct client, timer)));
+	}
+    }
+}
+
+/* (re)arms p's timer to fire kind in ms milliseconds, at tick granularity */
+void timerarm(struct client* p, int kind, long ms)
+{
+    timercancel(p);
+    // an empty wheel isn't ticked, so bring it up to date first
+    if(!wheel.count) {
+	wheel.now = tickms / TICKMS;
+    }
+    p->timer.kind = kind;
+    p->timer.expires = wheel.now + (ms > 0 ? (ms + TICKMS - 1) / TICKMS : 1);
+    wheelinsert(&p->timer);
+    wheel.count++;
+}
+
+/* disarms p's timer if it is armed */
+void timercancel(struct client* p)
+{
+    struct timer* t = &p->timer;
+
+    if(t->next) {
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = NULL;
+	wheel.count--;
+    }
+}
+
+/* splits fmt into t's literal pieces and holes; fmt must outlive t */
+void tmplinit(struct template* t, const char* fmt)
+{
+    const char* lit = fmt;
+
+    t->n = 0;
+    while(*fmt) {
+	if(fmt[0] != '%' || !fmt[1]) {
+	    fmt++;
+	    continue;
+	}
+	// a literal, this hole and the text after it must all fit
+	if(t->n + 3 > TMPLPIECES) {
+	    fprintf(stderr, "template too long: %s\n", fmt);
+	    exit(1);
+	}
+	if(fmt > lit) {
+	    t->pieces[t->n++] = (struct piece){ lit, fmt - lit, 0 };
+	}
+	t->pieces[t->n++] = (struct piece){ NULL, 0, fmt[1] };
+	fmt += 2;
+	lit = fmt;
+    }
+    if(*lit) {
+	t->pieces[t->n++] = (struct piece){ lit, strlen(lit), 0 };
+    }
+}
+
+/* decimal digits of v into buf, without a terminating null; returns how many */
+static int fmtint(char* buf, int v)
+{
+    char tmp[12];
+    unsigned int u = v < 0 ? -(unsigned int)v : v;
+    int n = 0, len = 0;
+
+    do {
+	tmp[n++] = '0' + u % 10;
+	u /= 10;
+    } while(u);
+    if(v < 0) {
+	buf[len++] = '-';
+    }
+    while(n) {
+	buf[len++] = tmp[--n];
+    }
+    return len;
+}
+
+/* appends template t to m, filling its holes from the arguments in order:
+ * a struct client* for %N, an int for %d, and a char* and int length for %s */
+void msgadd(struct msg* m, const struct template* t, ...)
+{
+    va_list ap;
+    int i;
+
+    va_start(ap, t);
+    for(i = 0; i < t->n && m->n < MSGIOV; i++) {
+	const struct piece* pc = &t->pieces[i];
+	struct iovec* v = &m->iov[m->n++];
+	if(!pc->hole) {
+	    v->iov_base = (void*)pc->s;
+	    v->iov_len = pc->len;
+	} else if(pc->hole == 'N') {
+	    struct client* p = va_arg(ap, struct client*);
+	    v->iov_base = p->name;
+	    v->iov_len = p->namelen;
+	} else if(pc->hole == 's') {
+	    v->iov_base = va_arg(ap, char*);
+	    v->iov_len = va_arg(ap, int);
+	} else if(pc->hole == 'd' && m->nnums < MSGNUMS) {
+	    v->iov_base = m->nums[m->nnums];
+	    v->iov_len = fmtint(m->nums[m->nnums++], va_arg(ap, int));
+	} else {
+	    m->n--;
+	}
+    }
+    va_end(ap);
+}
+
+/* appends len bytes of literal text s to m */
+void msglit(struct msg* m, const char* s, int len)
+{
+    if(m->n < MSGIOV) {
+	m->iov[m->n].iov_base = (void*)s;
+	m->iov[m->n++].iov_len = len;
+    }
+}
+
+/* queues m for p and empties m for reuse */
+void msgsend(struct client* p, struct msg* m)
+{
+    if(m->n) {
+	queueoutv(p, m->iov, m->n);
+    }
+    m->n = m->nnums = 0;
+}
+
+/* FNV-1a of len bytes of data, continuing from h */
+static unsigned long fnv(unsigned long h, const void* data, int len)
+{
+    const unsigned char* b = data;
+
+    while(len--) {
+	h = (h ^ *b++) * 1099511628211UL;
+    }
+    return h;
+}
+
+/* appends a record of type for the client on fd to the journal, if there is one */
+void journalput(int type, int fd, const void* data, int len)
+{
+    struct jrec r;
+
+    if(!journal) {
+	return;
+    }
+    r.type = type;
+    r.pad = 0;
+    r.len = len;
+    r.fd = fd;
+    fwrite(&r, sizeof(r), 1, journal);
+    if(len) {
+	fwrite(data, len, 1, journal);
+    }
+}
+
+/* reads the next journal record into r and its payload into data (INREAD bytes);
+ * returns 0 at the end of the journal, including a record cut short by a crash */
+static int jread(FILE* in, struct jrec* r, char* data)
+{
+    if(fread(r, sizeof(*r), 1, in) != 1 || r->len > INREAD) {
+	return 0;
+    }
+    return !r->len || fread(data, r->len, 1, in) == 1;
+}
+
+/* does what journal record r says happened to a client */
+static void replayevent(struct clienttab* tab, struct jrec* r, char* data)
+{
+    struct client* p = r->fd >= 0 && r->fd < tab->fdcap ? tab->byfd[r->fd] : NULL;
+    struct in_addr addr;
+
+    if(r->type == J_ACCEPT && !p && r->len == sizeof(addr)) {
+	memcpy(&addr, data, sizeof(addr));
+	welcome(tab, r->fd, addr);
+    } else if(!p || p->dead) {
+	return;
+    } else if(r->type == J_READ) {
+	takeinput(p, tab, data, r->len);
+    } else if(r->type == J_CLOSE || r->type == J_DROP) {
+	killclient(p);
+    }
+}
+
+/* runs the journal at path through the game engine as shard sh, one journaled tick
+ * at a time with the clock the tick had, then prints what happened. there are no
+ * sockets: clients are known by the fds they had, and their output goes into a
+ * digest, so two builds given the same journal should print the same digest */
+void runreplay(struct shard* sh, const char* path)
+{
+    FILE* in = fopen(path, "rb");
+    struct clienttab clients;
+    struct jhead h;
+    struct jrec r;
+    char data[INREAD];
+    long ticks = 0, records = 0, cmds = 0, start = now_ns(), ns;
+    int more, i;
+
+    if(!in) {
+	perror(path);
+	exit(1);
+    }
+    if(fread(&h, sizeof(h), 1, in) != 1 || memcmp(h.magic, JMAGIC, sizeof(h.magic))) {
+	fprintf(stderr, "%s: not a journal\n", path);
+	exit(1);
+    }
+    self = sh;
+    seed = h.seed;
+    memset(&games, 0, sizeof(games));
+    memset(&clients, 0, sizeof(clients));
+    memset(&waiting, 0, sizeof(waiting));
+    flushlist = deadlist = NULL;
+    replaying = 1;
+    replaydigest = 14695981039346656037UL;
+    more = jread(in, &r, data);
+    if(more && r.type == J_TICK) {
+	memcpy(&tickms, data, sizeof(tickms));
+    }
+    wheelinit(tickms / TICKMS);
+    // each pass starts with r holding a tick's J_TICK record
+    while(more && r.type == J_TICK && r.len == sizeof(tickms)) {
+	memcpy(&tickms, data, sizeof(tickms));
+	ticks++;
+	records++;
+	inevents = 1;
+	while((more = jread(in, &r, data)) && r.type != J_TICK && r.type != J_DROP) {
+	    replayevent(&clients, &r, data);
+	    records++;
+	}
+	inevents = 0;
+	playtick(&clients);
+	for(; more && r.type == J_DROP; more = jread(in, &r, data)) {
+	    replayevent(&clients, &r, data);
+	    records++;
+	}
+	endtick(&clients);
+    }
+    if(more) {
+	fprintf(stderr, "%s: record %ld is out of place; stopping there\n", path, records + 1);
+    }
+    fclose(in);
+    free(clients.byfd);
+    free(clients.slots);
+    ns = now_ns() - start;
+    for(i = 0; i < NCMDS; i++) {
+	cmds += READ(sh->m.commands[i]);
+    }
+    printf("replayed %ld records in %ld ticks in %.3f s (%.0f records/s)\n",
+	records, ticks, ns / 1e9, records / (ns / 1e9));
+    printf("%ld connections, %ld games started, %ld finished, %ld commands, %ld bytes in, %ld out\n",
+	READ(sh->m.accepts), READ(sh->m.gamesstarted), READ(sh->m.gamesfinished), cmds,
+	READ(sh->m.bytesin), READ(sh->m.bytesout));
+    printf("output digest %016lx\n", replaydigest);
+}
+
+/* maps the player stats file at path, making it first if there is none. only
+ * the header is read; the index and records are used where they lie */
+void statsopen(const char* path)
+{
+    struct statshead h;
+    struct stat st;
+    size_t recoff, size;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    void* map;
+
+    if(fd < 0 || fstat(fd, &st)) {
+	perror(path);
+	exit(1);
+    }
+    if(st.st_size == 0) {
+	// a new file is sparse: the index and the records read as zeroes until used
+	memcpy(h.magic, SMAGIC, sizeof(h.magic));
+	h.recsize = sizeof(struct pstats);
+	h.cap = STATSCAP;
+	atomic_init(&h.count, 0);
+    } else if(pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, SMAGIC, sizeof(h.magic)) ||
+	h.recsize != sizeof(struct pstats) || !h.cap || h.cap & (h.cap - 1)) {
+	fprintf(stderr, "%s: not a player stats file\n", path);
+	exit(1);
+    }
+    recoff = (sizeof(h) + 2 * (size_t)h.cap * sizeof(unsigned int) + 4095) & ~(size_t)4095;
+    size = recoff + (size_t)h.cap * sizeof(struct pstats);
+    if(st.st_size == 0 && (ftruncate(fd, size) || pwrite(fd, &h, sizeof(h), 0) != sizeof(h))) {
+	perror(path);
+	exit(1);
+    }
+    if(st.st_size != 0 && st.st_size < size) {
+	fprintf(stderr, "%s: truncated\n", path);
+	exit(1);
+    }
+    if((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	perror("mmap");
+	exit(1);
+    }
+    close(fd);
+    statsfile = map;
+    statsindex = (_Atomic unsigned int*)(statsfile + 1);
+    statsrecs = (struct pstats*)((char*)map + recoff);
+    logmsg(LOG_INFO, "player stats: %d of %d records used", (int)READ(statsfile->count), (int)statsfile->cap);
+}
+
+/* the record of the player called name, made if there is none; nostats if there
+ * is no stats file, or no room left in it. any shard may ask: a new record is
+ * claimed with an atomic add and published by a compare-and-swap on its index
+ * slot, so if two shards add one name at once, the loser uses the winner's */
+struct pstats* statsfind(const char* name, int len)
+{
+    unsigned int mask, i, at, mine = 0;
+
+    if(!statsfile) {
+	return &nostats;
+    }
+    mask = 2 * statsfile->cap - 1;
+    for(i = fnv(14695981039346656037UL, name, len) & mask; ; i = (i + 1) & mask) {
+	at = atomic_load_explicit(&statsindex[i], memory_order_acquire);
+	if(!at) {
+	    if(!mine) {
+		if((mine = atomic_fetch_add(&statsfile->count, 1) + 1) > statsfile->cap) {
+		    logmsg(LOG_WARN, "player stats file full; %s goes unrecorded", name);
+		    return &nostats;
+		}
+		memcpy(statsrecs[mine - 1].name, name, len + 1);
+	    }
+	    if(atomic_compare_exchange_strong_explicit(&statsindex[i], &at, mine,
+		memory_order_release, memory_order_acquire)) {
+		return &statsrecs[mine - 1];
+	    }
+	    // another shard just took the slot; at is now its record
+	}
+	if(!strcmp(statsrecs[at - 1].name, name)) {
+	    return &statsrecs[at - 1];
+	}
+    }
+}
+
+/* stops this shard for a hot restart. once every shard has stopped, nobody hands
+ * anyone over, so each empties its inbox for good and writes out its state; then
+ * it waits to be told the handover failed, and carries on as if nothing happened */
+static void park(struct clienttab* tab)
+{
+    atomic_fetch_add(&parked, 1);
+    while(atomic_load(&parked) < nshards) {
+	usleep(1000);
+    }
+    takehandoffs(tab);
+    snapshot(tab);
+    atomic_fetch_add(&snapped, 1);
+    while(atomic_load(&restarting)) {
+	usleep(1000);
+    }
+    free(self->snap);
+    free(self->snapfds);
+    self->snap = NULL;
+    self->snapfds = NULL;
+}
+
+/* appends p's record to out, and its fd to the shard's snapshot fds */
+static void putclient(FILE* out, struct client* p)
+{
+    struct hclient h;
+    struct outchunk* c;
+
+    memset(&h, 0, sizeof(h));
+    h.fd = p->fd;
+    h.ipaddr = p->ipaddr;
+    memcpy(h.name, p->name, sizeof(h.name));
+    h.namelen = p->namelen;
+    h.curlen = p->curlen;
+    h.outbytes = p->outbytes;
+    h.curgame = p->curgame;
+    h.watching = p->watching;
+    h.waiting = p->waiting;
+    h.lastplayed = p->lastplayed ? p->lastplayed->fd : -1;
+    h.waitsince = p->waitsince;
+    h.lastinput = p->lastinput;
+    h.timer = p->timer.next ? p->timer.kind : -1;
+    h.expires = p->timer.expires;
+    h.rating = p->rating;
+    h.binary = p->binary;
+    fwrite(&h, sizeof(h), 1, out);
+    if(p->curlen) {
+	fwrite(p->curmessage, 1, p->curlen, out);
+    }
+    for(c = p->outhead; c; c = c->next) {
+	fwrite((c->ref ? c->ref->data : c->data) + c->off, 1, c->len - c->off, out);
+    }
+    self->snapfds[self->nsnapfds++] = p->fd;
+}
+
+/* writes this shard's part of the snapshot (see struct hshard) to self->snap */
+static void snapshot(struct clienttab* tab)
+{
+    struct hshard hs;
+    struct hgame h;
+    struct client* p;
+    unsigned long bits;
+    FILE* out;
+    int i, g;
+
+    if(!(out = open_memstream(&self->snap, &self->snaplen)) ||
+	!(self->snapfds = malloc((tab->count + 1) * sizeof(int)))) {
+	perror("snapshot");
+	exit(1);
+    }
+    self->nsnapfds = 0;
+    memset(&hs, 0, sizeof(hs));
+    hs.nclients = tab->count;
+    hs.ngames = games.count;
+    hs.nready = games.nready;
+    hs.maxfd = -1;
+    for(i = 0; i < tab->count; i++) {
+	if(tab->slots[i]->fd > hs.maxfd) {
+	    hs.maxfd = tab->slots[i]->fd;
+	}
+    }
+    fwrite(&hs, sizeof(hs), 1, out);
+    for(g = 0; g < games.count; g++) {
+	memset(&h, 0, sizeof(h));
+	h.mode = games.mode[g];
+	h.turn = games.turn[g];
+	for(i = 0; i < 2; i++) {
+	    h.hp[i] = games.hp[i][g];
+	    h.pm[i] = games.pm[i][g];
+	    h.players[i] = h.mode != 5 ? games.players[i][g]->fd : -1;
+	}
+	h.rng = games.rng[g];
+	fwrite(&h, sizeof(h), 1, out);
+    }
+    fwrite(games.ready, sizeof(int), games.nready, out);
+    for(bits = waiting.nonempty; bits; bits &= bits - 1) {
+	for(p = waiting.head[__builtin_ctzl(bits)]; p; p = p->waitnext) {
+	    putclient(out, p);
+	}
+    }
+    for(i = 0; i < tab->count; i++) {
+	if(!tab->slots[i]->waiting) {
+	    putclient(out, tab->slots[i]);
+	}
+    }
+    if(fclose(out)) {
+	perror("snapshot");
+	exit(1);
+    }
+    ((struct hshard*)self->snap)->len = self->snaplen;
+}
+
+/* rebuilds this shard's games and clients from its part of the snapshot a
+ * hot restart handed over, and starts watching the clients' fds */
+static void resume(struct clienttab* tab)
+{
+    const char* s = self->snap;
+    struct hshard hs;
+    struct hgame h;
+    struct hclient c;
+    struct client **byfd, **restored, *p;
+    int *lastplayed, *ready, i, g;
+
+    memcpy(&hs, s, sizeof(hs));
+    s += sizeof(hs);
+    if(hs.ngames) {
+	gamegrow(&games, hs.ngames);
+    }
+    games.count = hs.ngames;
+    for(g = 0; g < hs.ngames; g++, s += sizeof(h)) {
+	memcpy(&h, s, sizeof(h));
+	games.mode[g] = h.mode;
+	games.turn[g] = h.turn;
+	for(i = 0; i < 2; i++) {
+	    games.hp[i][g] = h.hp[i];
+	    games.pm[i][g] = h.pm[i];
+	}
+	games.rng[g] = h.rng;
+	games.readyat[g] = -1;
+	games.watchers[g] = NULL;
+	if(h.mode == 5) {
+	    games.freeids[games.nfree++] = g;
+	}
+    }
+    ready = (int*)s;
+    for(i = 0; i < hs.nready; i++) {
+	games.readyat[ready[i]] = games.nready;
+	games.ready[games.nready++] = ready[i];
+    }
+    s += hs.nready * sizeof(int);
+    // games and lastplayed name clients by their old fds
+    byfd = calloc(hs.maxfd + 2, sizeof(struct client*));
+    restored = malloc((hs.nclients + 1) * sizeof(struct client*));
+    lastplayed = malloc((hs.nclients + 1) * sizeof(int));
+    if(!byfd || !restored || !lastplayed) {
+	perror("resume");
+	exit(1);
+    }
+    for(i = 0; i < hs.nclients; i++) {
+	memcpy(&c, s, sizeof(c));
+	s += sizeof(c);
+	p = addclient(tab, self->snapfds[i], c.ipaddr);
+	countconn(c.ipaddr, 1);
+	memcpy(p->name, c.name, sizeof(p->name));
+	p->namelen = c.namelen;
+	if(c.curlen) {
+	    memcpy(inbuf(p), s, c.curlen);
+	}
+	p->curlen = c.curlen;
+	s += c.curlen;
+	if(c.outbytes) {
+	    queueout(p, s, c.outbytes);
+	}
+	s += c.outbytes;
+	p->curgame = c.curgame;
+	p->rating = c.rating;
+	p->binary = c.binary;
+	p->lastinput = c.lastinput;
+	if(p->namelen) {
+	    p->stats = statsfind(p->name, p->namelen);
+	}
+	if(c.waiting) {
+	    pushtoback(&waiting, p);
+	    p->waitsince = c.waitsince;
+	}
+	if(c.watching >= 0) {
+	    watch(p, c.watching);
+	}
+	if(c.timer >= 0) {
+	    timerarm(p, c.timer, c.expires * TICKMS - tickms);
+	} else {
+	    timercancel(p);
+	}
+	byfd[c.fd] = restored[i] = p;
+	lastplayed[i] = c.lastplayed;
+	// registering reports any input or buffer space that turned up in the handover
+	watchfd(self->epfd, p->fd, p, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+    }
+    for(i = 0; i < hs.nclients; i++) {
+	if(lastplayed[i] >= 0 && lastplayed[i] <= hs.maxfd) {
+	    restored[i]->lastplayed = byfd[lastplayed[i]];
+	}
+    }
+    for(g = 0; g < hs.ngames; g++) {
+	memcpy(&h, self->snap + sizeof(hs) + g * sizeof(h), sizeof(h));
+	for(i = 0; i < 2; i++) {
+	    games.players[i][g] = h.mode != 5 ? byfd[h.players[i]] : NULL;
+	}
+    }
+    logmsg(LOG_INFO, "resumed %d clients and %d games", hs.nclients, hs.ngames - games.nfree);
+    free(byfd);
+    free(restored);
+    free(lastplayed);
+    self->snap = NULL;
+    self->snapfds = NULL;
+}
+
+/* writes or reads all len bytes of buf on a blocking socket; -1 on failure */
+static int sendall(int fd, const void* buf, size_t len)
+{
+    ssize_t n;
+
+    for(; len; buf = (const char*)buf + n, len -= n) {
+	if((n = write(fd, buf, len)) <= 0) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+static int recvall(int fd, void* buf, size_t len)
+{
+    ssize_t n;
+
+    for(; len; buf = (char*)buf + n, len -= n) {
+	if((n = read(fd, buf, len)) <= 0) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/* passes n fds over Unix socket sock, HFDBATCH to a one-byte message */
+static int sendfds(int sock, const int* fds, int n)
+{
+    union {
+	struct cmsghdr h;
+	char buf[CMSG_SPACE(HFDBATCH * sizeof(int))];
+    } u;
+    struct msghdr msg;
+    struct cmsghdr* cm;
+    struct iovec iov;
+    char c = 0;
+    int k;
+
+    for(; n > 0; fds += k, n -= k) {
+	k = n < HFDBATCH ? n : HFDBATCH;
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = CMSG_SPACE(k * sizeof(int));
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(k * sizeof(int));
+	memcpy(CMSG_DATA(cm), fds, k * sizeof(int));
+	if(sendmsg(sock, &msg, 0) != 1) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/* takes n fds passed by sendfds() into fds */
+static int recvfds(int sock, int* fds, int n)
+{
+    union {
+	struct cmsghdr h;
+	char buf[CMSG_SPACE(HFDBATCH * sizeof(int))];
+    } u;
+    struct msghdr msg;
+    struct cmsghdr* cm;
+    struct iovec iov;
+    char c;
+    int k;
+
+    for(; n > 0; fds += k, n -= k) {
+	k = n < HFDBATCH ? n : HFDBATCH;
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+	if(recvmsg(sock, &msg, 0) != 1 || msg.msg_flags & MSG_CTRUNC ||
+	    !(cm = CMSG_FIRSTHDR(&msg)) || cm->cmsg_type != SCM_RIGHTS ||
+	    cm->cmsg_len != CMSG_LEN(k * sizeof(int))) {
+	    return -1;
+	}
+	memcpy(fds, CMSG_DATA(cm), k * sizeof(int));
+    }
+    return 0;
+}
+
+/* stops every shard between ticks and hands everything to the server on sock:
+ * the snapshot, then the fds. returns 1 once that server says it has it all,
+ * and 0, with every shard running again, if it never does */
+static int handover(int sock)
+{
+    struct hhead h;
+    int i, n, *fds, ok = 0;
+    long start = now_ms();
+    char ack;
+
+    atomic_store(&restarting, 1);
+    for(i = 0; i < nshards; i++) {
+	eventfd_write(shards[i].wakefd, 1);
+    }
+    while(atomic_load(&snapped) < nshards) {
+	usleep(1000);
+    }
+    memcpy(h.magic, HMAGIC, sizeof(h.magic));
+    h.nshards = nshards;
+    h.admin = adminfd >= 0;
+    h.nfds = nshards + h.admin;
+    h.len = 0;
+    for(i = 0; i < nshards; i++) {
+	h.nfds += shards[i].nsnapfds;
+	h.len += shards[i].snaplen;
+    }
+    if(!(fds = malloc(h.nfds * sizeof(int)))) {
+	perror("malloc");
+	exit(1);
+    }
+    for(i = 0; i < nshards; i++) {
+	fds[i] = shards[i].listenfd;
+    }
+    n = nshards;
+    if(h.admin) {
+	fds[n++] = adminfd;
+    }
+    for(i = 0; i < nshards; i++) {
+	memcpy(fds + n, shards[i].snapfds, shards[i].nsnapfds * sizeof(int));
+	n += shards[i].nsnapfds;
+    }
+    if(!sendall(sock, &h, sizeof(h))) {
+	for(i = 0; i < nshards && !sendall(sock, shards[i].snap, shards[i].snaplen); i++)
+	    ;
+	ok = i == nshards && !sendfds(sock, fds, n) && recvall(sock, &ack, 1) == 0;
+    }
+    free(fds);
+    if(ok) {
+	logmsg(LOG_INFO, "handed over %d fds and %ld bytes of state in %ld ms", n, (long)h.len, now_ms() - start);
+	return 1;
+    }
+    logmsg(LOG_WARN, "hot restart failed; carrying on");
+    atomic_store(&parked, 0);
+    atomic_store(&snapped, 0);
+    atomic_store(&restarting, 0);
+    return 0;
+}
+
+/* serves the restart socket: the first server to connect and take everything
+ * over replaces this one, which exits */
+void* runrestart(void* arg)
+{
+    struct timeval tv = { 5, 0 };
+    int fd;
+
+    logmsg(LOG_INFO, "hot restart socket on %s", restartpath);
+    while(1) {
+	if((fd = accept(restartfd, NULL, NULL)) < 0) {
+	    continue;
+	}
+	// the shards are stopped for as long as a handover takes, so a stuck one is given up on
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if(handover(fd)) {
+	    logwait();
+	    exit(0);
+	}
+	close(fd);
+    }
+    return NULL;
+}
+
+/* takes over from the server listening on the restart socket at path, if there
+ * is one: sets up shards as it had them, with its listeners, and with each
+ * shard's part of its snapshot for runshard() to resume. returns 0 if there is
+ * nobody to take over from, and exits if the handover goes wrong */
+int takeover(const char* path)
+{
+    struct sockaddr_un a;
+    struct hhead h;
+    int sock, i, n, *fds;
+    char* snap;
+
+    memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    strncpy(a.sun_path, path, sizeof(a.sun_path) - 1);
+    if((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+	perror("socket");
+	exit(1);
+    }
+    if(connect(sock, (struct sockaddr*)&a, sizeof(a))) {
+	close(sock);
+	return 0;
+    }
+    if(recvall(sock, &h, sizeof(h)) || memcmp(h.magic, HMAGIC, sizeof(h.magic)) ||
+	!(snap = malloc(h.len)) || !(fds = malloc(h.nfds * sizeof(int))) ||
+	recvall(sock, snap, h.len) || recvfds(sock, fds, h.nfds)) {
+	fprintf(stderr, "%s: hot restart failed\n", path);
+	exit(1);
+    }
+    if(nshards != h.nshards) {
+	fprintf(stderr, "%s: running %d shards, as the server taken over did\n", path, h.nshards);
+    }
+    nshards = h.nshards;
+    if(!(shards = calloc(nshards, sizeof(struct shard)))) {
+	perror("calloc");
+	exit(1);
+    }
+    n = nshards;
+    if(h.admin) {
+	adminfd = fds[n++];
+    }
+    // the shards' parts stay where they were read; they are small, and read once
+    for(i = 0; i < nshards; i++) {
+	shards[i].listenfd = fds[i];
+	shards[i].snap = snap;
+	shards[i].snaplen = ((struct hshard*)snap)->len;
+	shards[i].snapfds = fds + n;
+	shards[i].nsnapfds = ((struct hshard*)snap)->nclients;
+	snap += shards[i].snaplen;
+	n += shards[i].nsnapfds;
+    }
+    // the old server exits once it hears this; everything it had is ours
+    if(sendall(sock, "k", 1)) {
+	fprintf(stderr, "%s: hot restart failed\n", path);
+	exit(1);
+    }
+    close(sock);
+    return 1;
+}
+
+/* binds the restart socket at path, in place of any left behind or any the
+ * server just taken over was using */
+int restartlisten(const char* path)
+{
+    struct sockaddr_un a;
+    int fd;
+
+    memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    strncpy(a.sun_path, path, sizeof(a.sun_path) - 1);
+    unlink(path);
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	bind(fd, (struct sockaddr*)&a, sizeof(a)) || listen(fd, 1)) {
+	perror(path);
+	exit(1);
+    }
+    return fd;
+}
+
+/* drains a backend (SIGUSR1): linktick() passes it on to the gateways */
+void drain(int sig)
+{
+    atomic_store(&draining, 1);
+}
+
+/* adds every backend in list, "host:port,host:port,..." to backends; a bad one is fatal.
+ * list is left as it is, so ps still shows the command line it came from */
+void backendsparse(char* list)
+{
+    struct addrinfo hints, *res;
+    char *copy, *s, *port;
+
+    if(!(copy = strdup(list))) {
+	perror("strdup");
+	exit(1);
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    for(s = strtok(copy, ","); s; s = strtok(NULL, ",")) {
+	if(!(port = strrchr(s, ':'))) {
+	    fprintf(stderr, "%s: a backend is host:port\n", s);
+	    exit(1);
+	}
+	*port++ = '\0';
+	if(getaddrinfo(*s ? s : "127.0.0.1", port, &hints, &res)) {
+	    fprintf(stderr, "%s:%s: no such backend\n", s, port);
+	    exit(1);
+	}
+	if(!(backends = realloc(backends, (nbackends + 1) * sizeof(struct sockaddr_in)))) {
+	    perror("realloc");
+	    exit(1);
+	}
+	memcpy(&backends[nbackends++], res->ai_addr, sizeof(struct sockaddr_in));
+	freeaddrinfo(res);
+    }
+    free(copy);
+}
+
+/* backend b could not be reached, or its link went down: it is tried again after
+ * LOADMS, then twice as long after each failure, up to LINKMAXMS. returns 1 if
+ * b was up (or not tried) until now, so the loss is logged once, not at every retry */
+static int linkbackoff(int b)
+{
+    int was = !linkdelay[b];
+
+    linkdelay[b] = was ? LOADMS : linkdelay[b] * 2 < LINKMAXMS ? linkdelay[b] * 2 : LINKMAXMS;
+    linkretry[b] = tickms + linkdelay[b];
+    return was;
+}
+
+/* a gateway's shard starts connecting to backend b. frames are queued as soon as
+ * there is a link, but nothing is placed on it until the backend reports its load */
+static void linkup(struct clienttab* tab, int b)
+{
+    struct client* p;
+    int fd, yes = 1;
+
+    if((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+	logmsg(LOG_ERROR, "socket: %e", errno);
+	return;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    if(connect(fd, (struct sockaddr*)&backends[b], sizeof(backends[b])) && errno != EINPROGRESS) {
+	logmsg(linkbackoff(b) ? LOG_WARN : LOG_DEBUG, "backend %a: %e", backends[b].sin_addr, errno);
+	close(fd);
+	return;
+    }
+    p = addclient(tab, fd, backends[b].sin_addr);
+    makelink(p, b);
+    links[b] = p;
+    watchfd(self->epfd, fd, p, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+}
+
+/* a backend's shard takes every gateway link waiting on its link listener,
+ * and tells each how loaded it is straight away */
+static void takelinks(struct clienttab* tab)
+{
+    struct sockaddr_in q;
+    socklen_t len;
+    struct client* p;
+    int fd, yes = 1;
+
+    while(1) {
+	len = sizeof(q);
+	if((fd = accept4(self->linkfd, (struct sockaddr*)&q, &len, SOCK_NONBLOCK)) < 0) {
+	    if(errno == ECONNABORTED || errno == EPROTO || errno == EINTR) {
+		continue;
+	    }
+	    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+		logmsg(LOG_ERROR, "accept: %e", errno);
+	    }
+	    return;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	logmsg(LOG_INFO, "gateway link from %a", q.sin_addr);
+	p = addclient(tab, fd, q.sin_addr);
+	makelink(p, -1);
+	watchfd(self->epfd, fd, p, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+	linkload(p);
+    }
+}
+
+/* makes client p a link, to backend if it is a gateway's, or from a gateway if backend is -1 */
+static void makelink(struct client* p, int backend)
+{
+    // a link is never idle, however quiet it is
+    timercancel(p);
+    if(!(p->ls = calloc(1, sizeof(struct linkstate)))) {
+	perror("calloc");
+	exit(1);
+    }
+    p->ls->backend = backend;
+    nlinks++;
+}
+
+/* games in progress on every shard */
+static long gamesplaying(void)
+{
+    long n = 0;
+    int i;
+
+    for(i = 0; i < nshards; i++) {
+	n += READ(shards[i].m.gamesstarted) - READ(shards[i].m.gamesfinished);
+    }
+    return n;
+}
+
+/* tells the gateway at the other end of link how many games this backend has,
+ * and that it is draining if it is */
+static void linkload(struct client* link)
+{
+    unsigned char d[4];
+    long n = gamesplaying();
+
+    d[0] = n >> 24;
+    d[1] = n >> 16;
+    d[2] = n >> 8;
+    d[3] = n;
+    linkput(link, L_LOAD, 0, d, 4);
+    if(drainsent) {
+	linkput(link, L_DRAIN, 0, NULL, 0);
+    }
+}
+
+/* a shard's link work, once an iteration: a gateway reconnects to backends it has
+ * lost, backing off while they stay away; a backend reports its load as often, passes on at once that it
+ * is draining, and once draining, exits when no shard has a gateway's player left */
+static void linktick(struct clienttab* tab)
+{
+    int i;
+
+    for(i = 0; i < nbackends; i++) {
+	if(!links[i] && tickms >= linkretry[i]) {
+	    linkup(tab, i);
+	}
+    }
+    if(!linkport) {
+	return;
+    }
+    // done once the last player has gone back, and the links have sent it all,
+    // the news that it is draining included
+    if(drainsent && !drained && !nvirtual) {
+	for(i = 0; i < tab->count && !(tab->slots[i]->ls && tab->slots[i]->outhead); i++)
+	    ;
+	if(i == tab->count) {
+	    drained = 1;
+	    if(atomic_fetch_add(&shardsdrained, 1) + 1 == nshards) {
+		logmsg(LOG_INFO, "drained, exiting");
+		logwait();
+		exit(0);
+	    }
+	}
+    }
+    if(tickms - loadsent >= LOADMS || (!drainsent && atomic_load(&draining))) {
+	if(!drainsent && atomic_load(&draining)) {
+	    drainsent = 1;
+	    logmsg(LOG_INFO, "draining: %d players from gateways here", nvirtual);
+	}
+	for(i = 0; i < tab->count; i++) {
+	    if(tab->slots[i]->ls) {
+		linkload(tab->slots[i]);
+	    }
+	}
+	loadsent = tickms;
+    }
+}
+
+/* queues a frame of type for stream, with n bytes of payload, on link */
+static void linkput(struct client* link, int type, unsigned int stream, const void* payload, int n)
+{
+    unsigned char h[LINKHEAD] = { type, stream >> 24, stream >> 16, stream >> 8, stream, n };
+    struct iovec iov[2] = { { h, LINKHEAD }, { (void*)payload, n } };
+
+    queueoutv(link, iov, n ? 2 : 1);
+}
+
+/* queues len bytes of buf for stream on link, LINKDATA bytes to a frame */
+static void linkdata(struct client* link, unsigned int stream, const char* buf, int len)
+{
+    int n;
+
+    for(; len > 0; buf += n, len -= n) {
+	n = len < LINKDATA ? len : LINKDATA;
+	linkput(link, L_DATA, stream, buf, n);
+    }
+}
+
+/* p, a gateway's player on a backend (on either end), is going: the other end is
+ * told, with p's rating and whether it is gone for good, and p is off the link */
+static void linkclose(struct client* p)
+{
+    struct linkstate* ls = p->link->ls;
+    unsigned char d[5] = { p->rating >> 24, p->rating >> 16, p->rating >> 8, p->rating, !p->release };
+
+    if(ls->backend < 0 && (p->stream >> 8) < ls->cap && ls->streams[p->stream >> 8] == p) {
+	ls->streams[p->stream >> 8] = NULL;
+    }
+    linkput(p->link, L_CLOSE, p->stream, d, 5);
+    p->link = NULL;
+}
+
+/* link is going: a gateway's players on it go back to waiting here, and a
+ * backend's players from it are dropped, as if they had left */
+static void linkdown(struct clienttab* tab, struct client* link)
+{
+    struct linkstate* ls = link->ls;
+    struct client* p;
+    int i;
+
+    if(ls->backend >= 0) {
+	// a backend that never came up is only reported the first time it fails
+	logmsg(linkbackoff(ls->backend) ? LOG_WARN : LOG_DEBUG, ls->up ? "lost backend %a" : "can't reach backend %a",
+	    link->ipaddr);
+	links[ls->backend] = NULL;
+	for(i = 0; i < tab->count; i++) {
+	    p = tab->slots[i];
+	    if(p->link != link) {
+		continue;
+	    }
+	    p->link = NULL;
+	    if(p->dead) {
+		continue;
+	    }
+	    if(!p->binary) {
+		queueout(p, "\r\nThe arena your battle was in went away. Finding a new opponent...\r\n",
+		    sizeof("\r\nThe arena your battle was in went away. Finding a new opponent...\r\n") - 1);
+	    }
+	    timerarm(p, TIMER_IDLE, idletimeout - (tickms - p->lastinput));
+	    pushtoback(&waiting, p);
+	}
+    } else {
+	logmsg(LOG_WARN, "lost gateway %a", link->ipaddr);
+	for(i = 0; i < ls->cap; i++) {
+	    if((p = ls->streams[i]) != NULL) {
+		p->link = NULL;
+		killclient(p);
+	    }
+	}
+    }
+    nlinks--;
+    free(ls->streams);
+    free(ls);
+    link->ls = NULL;
+}
+
+/* the client on link with stream id stream, if it is still there */
+static struct client* linkstream(struct client* link, struct clienttab* tab, unsigned int stream)
+{
+    struct linkstate* ls = link->ls;
+    unsigned int i = stream >> 8;
+    struct client* p;
+
+    if(ls->backend >= 0) {
+	p = i < tab->fdcap ? tab->byfd[i] : NULL;
+    } else {
+	p = i < ls->cap ? ls->streams[i] : NULL;
+    }
+    return p && !p->dead && p->link == link && p->stream == stream ? p : NULL;
+}
+
+/* a 32-bit big-endian number */
+static unsigned int get32(const unsigned char* d)
+{
+    return (unsigned int)d[0] << 24 | d[1] << 16 | d[2] << 8 | d[3];
+}
+
+/* the gateway at the other end of link has placed a player on this backend
+ * as stream: it joins as a client with no fd, named and ready to play */
+static void linkopen(struct client* link, struct clienttab* tab, unsigned int stream, const unsigned char* d, int n)
+{
+    struct linkstate* ls = link->ls;
+    unsigned int i = stream >> 8;
+    struct in_addr addr;
+    char name[NAMELEN + 1];
+    struct client* p;
+
+    if(i >= ls->cap) {
+	int cap = ls->cap ? ls->cap : 64;
+	while(cap <= i) {
+	    cap *= 2;
+	}
+	if(!(ls->streams = realloc(ls->streams, cap * sizeof(struct client*)))) {
+	    perror("realloc");
+	    exit(1);
+	}
+	memset(ls->streams + ls->cap, 0, (cap - ls->cap) * sizeof(struct client*));
+	ls->cap = cap;
+    }
+    // the gateway reused an fd while the last player on it was on its way out
+    if(ls->streams[i]) {
+	ls->streams[i]->link = NULL;
+    }
+    memcpy(&addr, d + 5, sizeof(addr));
+    n = n - 9 < NAMELEN ? n - 9 : NAMELEN;
+    memcpy(name, d + 9, n);
+    name[n] = '\0';
+    p = addclient(tab, -1, addr);
+    setname(p, name);
+    p->stats = statsfind(p->name, p->namelen);
+    p->rating = get32(d);
+    p->binary = d[4];
+    p->link = link;
+    p->stream = stream;
+    timerarm(p, TIMER_IDLE, idletimeout);
+    ls->streams[i] = p;
+    nvirtual++;
+}
+
+/* link sent a frame of type for stream, with n bytes of payload */
+static void linkframe(struct client* link, struct clienttab* tab, int type, unsigned int stream, const unsigned char* d, int n)
+{
+    struct linkstate* ls = link->ls;
+    struct client *p, *q;
+
+    if(type == L_LOAD && n == 4) {
+	if(!ls->up) {
+	    logmsg(LOG_INFO, "backend %a up", link->ipaddr);
+	    if(ls->backend >= 0) {
+		linkdelay[ls->backend] = 0;
+	    }
+	}
+	ls->up = 1;
+	ls->load = get32(d);
+	return;
+    }
+    if(type == L_DRAIN) {
+	if(!ls->draining) {
+	    logmsg(LOG_INFO, "backend %a draining", link->ipaddr);
+	}
+	ls->draining = 1;
+	return;
+    }
+    if(type == L_OPEN && ls->backend < 0 && n > 9) {
+	linkopen(link, tab, stream, d, n);
+	return;
+    }
+    if(!(p = linkstream(link, tab, stream))) {
+	return;
+    }
+    if(type == L_DATA && ls->backend >= 0) {
+	queueout(p, (const char*)d, n);
+    } else if(type == L_DATA) {
+	takeinput(p, tab, (const char*)d, n);
+    } else if(type == L_CLOSE && ls->backend >= 0 && n == 5) {
+	// the game is over: the player waits here again, rated as the backend left it
+	p->link = NULL;
+	p->rating = get32(d);
+	if(d[4]) {
+	    killclient(p);
+	} else {
+	    timerarm(p, TIMER_IDLE, idletimeout - (tickms - p->lastinput));
+	    pushtoback(&waiting, p);
+	}
+    } else if(type == L_CLOSE) {
+	// the player left the gateway
+	killclient(p);
+    } else if(type == L_PAIR && ls->backend < 0 && n == 4) {
+	if((q = linkstream(link, tab, get32(d))) && p->curgame < 0 && q->curgame < 0) {
+	    pushtoback(&waiting, p);
+	    pushtoback(&waiting, q);
+	    pairup(&waiting, p, q);
+	} else {
+	    requeue(p);
+	}
+    }
+}
+
+/* act on len bytes from link. frames are put together in curmessage as they
+ * arrive, however the reads split them, like a binary client's */
+static void takelink(struct client* link, struct clienttab* tab, const char* buf, int len)
+{
+    unsigned char* f = (unsigned char*)inbuf(link);
+    int n;
+
+    for(; len > 0 && !link->dead; buf += n, len -= n) {
+	// the header, then as much of the payload as this read has
+	n = link->curlen < LINKHEAD ? LINKHEAD - link->curlen : LINKHEAD + f[5] - link->curlen;
+	n = n < len ? n : len;
+	memcpy(link->curmessage + link->curlen, buf, n);
+	link->curlen += n;
+	if(link->curlen >= LINKHEAD && link->curlen == LINKHEAD + f[5]) {
+	    link->curlen = 0;
+	    linkframe(link, tab, f[0], get32(f + 1), f + LINKHEAD, f[5]);
+	}
+    }
+    inbufdone(link);
+}
+
+/* on a gateway, starts the game between older and newer on the least loaded backend
+ * that is up and not draining: each player is opened as a stream on its link, with
+ * anything it has typed, then the two are paired. returns 0 if no backend will do */
+static int place(struct client* older, struct client* newer)
+{
+    struct client *link = NULL, *p;
+    unsigned char d[9 + NAMELEN];
+    int i;
+
+    for(i = 0; i < nbackends; i++) {
+	struct client* l = links[i];
+	if(l && !l->dead && l->ls->up && !l->ls->draining && (!link || l->ls->load < link->ls->load)) {
+	    link = l;
+	}
+    }
+    if(!link) {
+	return 0;
+    }
+    for(i = 0; i < 2; i++) {
+	p = i ? newer : older;
+	p->link = link;
+	p->stream = (unsigned int)p->fd << 8 | streamseq++;
+	// the backend keeps the time now
+	timercancel(p);
+	d[0] = p->rating >> 24;
+	d[1] = p->rating >> 16;
+	d[2] = p->rating >> 8;
+	d[3] = p->rating;
+	d[4] = p->binary;
+	memcpy(d + 5, &p->ipaddr, 4);
+	memcpy(d + 9, p->name, p->namelen);
+	linkput(link, L_OPEN, p->stream, d, 9 + p->namelen);
+	if(p->curlen) {
+	    linkdata(link, p->stream, p->curmessage, p->curlen);
+	    p->curlen = 0;
+	    inbufdone(p);
+	}
+    }
+    d[0] = newer->stream >> 24;
+    d[1] = newer->stream >> 16;
+    d[2] = newer->stream >> 8;
+    d[3] = newer->stream;
+    linkput(link, L_PAIR, older->stream, d, 4);
+    link->ls->load++;
+    COUNT(self->m.gamesplaced, 1);
+    return 1;
+}
+
+/* p's game is over: it waits for another, or a gateway's player on a backend
+ * goes back to the gateway once the game's last output has gone with it */
+static void requeue(struct client* p)
+{
+    if(p->fd < 0) {
+	p->release = 1;
+	wantflush(p);
+	return;
+    }
+    pushtoback(&waiting, p);
+}
+
+/* grows every column of t to hold cap games */
+static void gamegrow(struct gametab* t, int cap)
+{
+    void** cols[] = {
+	(void**)&t->mode, (void**)&t->turn, (void**)&t->hp[0], (void**)&t->hp[1],
+	(void**)&t->pm[0], (void**)&t->pm[1], (void**)&t->rng, (void**)&t->players[0],
+	(void**)&t->players[1], (void**)&t->readyat, (void**)&t->ready, (void**)&t->batch,
+	(void**)&t->kind, (void**)&t->dealt, (void**)&t->freeids, (void**)&t->watchers,
+    };
+    size_t sizes[] = {
+	1, 1, sizeof(int), sizeof(int), sizeof(int), sizeof(int), sizeof(unsigned long),
+	sizeof(struct client*), sizeof(struct client*), sizeof(int), sizeof(int), sizeof(int),
+	1, sizeof(int), sizeof(int), sizeof(struct client*),
+    };
+    int i;
+
+    for(i = 0; i < sizeof(cols) / sizeof(cols[0]); i++) {
+	void* col = realloc(*cols[i], cap * sizes[i]);
+	if(!col) {
+	    perror("realloc");
+	    exit(1);
+	}
+	*cols[i] = col;
+    }
+    t->cap = cap;
+}
+
+/* a free game id in t, growing t by doubling if there is none */
+int gamenew(struct gametab* t)
+{
+    int g;
+
+    if(t->nfree) {
+	g = t->freeids[--t->nfree];
+    } else {
+	if(t->count == t->cap) {
+	    gamegrow(t, t->cap ? t->cap * 2 : 64);
+	}
+	g = t->count++;
+    }
+    t->watchers[g] = NULL;
+    return g;
+}
+
+/* the next number in a game's random sequence (xorshift64*) */
+static inline unsigned int rngnext(unsigned long* s)
+{
+    unsigned long x = *s;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *s = x;
+    return (x * 2685821657736338717UL) >> 32;
+}
+
+/* sets up game g from seed: who goes first, 20-30 hitpoints and 1-2 powermoves each */
+void gamestart(struct gametab* t, int g, unsigned long seed)
+{
+    unsigned long* rng = &t->rng[g];
+
+    // xorshift never leaves zero
+    *rng = seed | 1;
+    t->turn[g] = rngnext(rng) % 2;
+    t->hp[0][g] = rngnext(rng) % 11 + 20;
+    t->hp[1][g] = rngnext(rng) % 11 + 20;
+    t->pm[0][g] = rngnext(rng) % 2 + 1;
+    t->pm[1][g] = rngnext(rng) % 2 + 1;
+    t->mode[g] = 0;
+    t->readyat[g] = -1;
+}
+
+/* the battle rules, for game g: resolves its pending move and returns the damage
+ * done. an attack (mode 1) does 2-6 damage; a powermove (mode 3) does three times
+ * that, but misses half the time, and is used up either way. a move hands the turn
+ * over; the game is left in mode 0, and a game already there is untouched. it is
+ * all arithmetic, with no branches or boolean operators, so loops of it vectorise */
+static inline int battlelane(int g, unsigned char* restrict mode, unsigned char* restrict turns,
+    int* restrict hp0, int* restrict hp1, int* restrict pm0, int* restrict pm1,
+    unsigned long* restrict rng)
+{
+    unsigned long x = rng[g];
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    rng[g] = x;
+    unsigned int r = (x * 2685821657736338717UL) >> 32;
+    int turn = turns[g];
+    int power = mode[g] == 3;
+    int moved = power + (mode[g] == 1);
+    // the top bit decides a powermove's miss; the rest, the damage
+    int hit = moved - (power & (int)(r >> 31));
+    int dmg = hit * ((int)(r & 0x7fffffff) % 5 + 2) * (1 + 2 * power);
+    hp0[g] -= dmg * turn;
+    hp1[g] -= dmg * (1 - turn);
+    pm0[g] -= power * (1 - turn);
+    pm1[g] -= power * turn;
+    turns[g] = turn ^ moved;
+    mode[g] = 0;
+    return dmg;
+}
+
+/* battlelane() for games ids[0] .. ids[n - 1], or for games 0 .. n - 1 if ids is
+ * NULL, over columns that don't overlap; dealt[i] gets the damage done. kept out of
+ * line so the restrict promises survive: inlined, they are lost and nothing vectorises */
+static __attribute__((noinline)) void battlecols(const int* restrict ids, int n, unsigned char* restrict mode,
+    unsigned char* restrict turns, int* restrict hp0, int* restrict hp1, int* restrict pm0,
+    int* restrict pm1, unsigned long* restrict rng, int* restrict dealt)
+{
+    int i;
+
+    if(ids) {
+	for(i = 0; i < n; i++) {
+	    dealt[i] = battlelane(ids[i], mode, turns, hp0, hp1, pm0, pm1, rng);
+	}
+    } else {
+	for(i = 0; i < n; i++) {
+	    dealt[i] = battlelane(i, mode, turns, hp0, hp1, pm0, pm1, rng);
+	}
+    }
+}
+
+/* resolves games ids[0] .. ids[n - 1] of t (all of 0 .. n - 1 if ids is NULL) by
+ * battlelane(); dealt[i] gets the damage done, 0 for a miss or no move. only t is
+ * touched, so it runs the same in the server and in simulate() */
+void battlepass(struct gametab* t, const int* ids, int n, int* dealt)
+{
+    battlecols(ids, n, t->mode, t->turn, t->hp[0], t->hp[1], t->pm[0], t->pm[1], t->rng, dealt);
+}
+
+/* plays battles games to the end with no server, many at once, and prints how
+ * fast it went and how the battles went. the mover uses a powermove half the
+ * time when they have one left, and attacks otherwise */
+void simulate(long battles)
+{
+    struct gametab t;
+    int lanes = battles < SIMLANES ? battles : SIMLANES;
+    int* first = malloc(lanes * sizeof(int));
+    int* dealt = malloc(lanes * sizeof(int));
+    long done = 0, started = 0, turns = 0, firstwins = 0;
+    long start = now_ns(), ns;
+    unsigned long seed = time(NULL);
+    int g, live = lanes;
+
+    if(!first || !dealt) {
+	perror("malloc");
+	exit(1);
+    }
+    memset(&t, 0, sizeof(t));
+    gamegrow(&t, lanes);
+    t.count = lanes;
+    for(g = 0; g < lanes; g++) {
+	gamestart(&t, g, seed + started++ * 0x9e3779b97f4a7c15UL);
+	first[g] = t.turn[g];
+    }
+    while(done < battles) {
+	for(g = 0; g < lanes; g++) {
+	    t.mode[g] = t.pm[t.turn[g]][g] && rngnext(&t.rng[g]) & 1 ? 3 : 1;
+	}
+	battlepass(&t, NULL, lanes, dealt);
+	turns += live;
+	for(g = 0; g < lanes; g++) {
+	    if(t.hp[0][g] > 0 && t.hp[1][g] > 0) {
+		continue;
+	    }
+	    // the loser is on turn, and the winner made the last move
+	    firstwins += (!t.turn[g]) == first[g];
+	    done++;
+	    if(started < battles) {
+		gamestart(&t, g, seed + started++ * 0x9e3779b97f4a7c15UL);
+		first[g] = t.turn[g];
+	    } else {
+		// park the lane where nobody can lose again
+		t.hp[0][g] = t.hp[1][g] = 1 << 30;
+		live--;
+	    }
+	}
+    }
+    ns = now_ns() - start;
+    printf("simulated %ld battles in %.3f s (%.0f battles/s, %.0f turns/s)\n",
+	done, ns / 1e9, done / (ns / 1e9), turns / (ns / 1e9));
+    printf("%.2f turns a battle, first mover won %.1f%%\n",
+	(double)turns / done, 100.0 * firstwins / done);
+    free(first);
+    free(dealt);
+}